@@ -0,0 +1,546 @@
+// End-to-end latency benchmark for the flat panel driver.
+//
+// Starts the firmware simulator and indiserver running the driver, connects as
+// an INDI client over XML and measures the time from sending a new property
+// value to receiving the matching update with state Ok:
+//
+//   OPEN / CLOSE   Cover Control, completes when the firmware reports the position
+//   BRIGHTNESS     Brightness Control, completes when the firmware acknowledges it
+//
+// then runs closed-loop brightness changes for a fixed time to get sustained
+// commands per second. Results are printed and optionally written as JSON.
+//
+// The driver and simulator are built as described at the top of their sources.
+//
+//   g++ -std=c++17 -O2 -o flatpanel_latency_bench flatpanel_latency_bench.cpp
+//   ./flatpanel_latency_bench --driver ./indi_flatpanel --simulator ./flatpanel_simulator --json results.json
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static const char *deviceName = "PrometheusAstro Flat Panel Cover";
+
+struct BenchOptions
+{
+    std::string driver = "indi_flatpanel";
+    std::string simulator = "flatpanel_simulator";
+    std::string indiserver = "indiserver";
+    std::string simulatorArgs = "--motion-ms 0";
+    std::string json;
+    int port = 7625;
+    int iterations = 1000;
+    int throughputSeconds = 5;
+    int timeoutMs = 5000;
+};
+
+struct Result
+{
+    std::string name;
+    std::vector<double> samples;
+    int timeouts = 0;
+};
+
+static pid_t spawn(const std::vector<std::string> &args, int *stdoutPipe)
+{
+    int fds[2];
+    if (stdoutPipe != nullptr && pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (stdoutPipe != nullptr)
+        {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        std::vector<char *> argv;
+        for (const std::string &arg : args)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    if (stdoutPipe != nullptr)
+    {
+        close(fds[1]);
+        *stdoutPipe = fds[0];
+    }
+    return pid;
+}
+
+static std::vector<std::string> splitArgs(const std::string &text)
+{
+    std::vector<std::string> args;
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find(' ', start);
+        if (end == std::string::npos)
+            end = text.size();
+        if (end > start)
+            args.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return args;
+}
+
+// Minimal INDI XML client: sends new*Vector elements and hands back complete
+// set*Vector/def*Vector elements as strings.
+class IndiConnection
+{
+public:
+    bool open(int port, int timeoutMs);
+    bool send(const std::string &xml);
+    bool nextElement(std::string &element, Clock::time_point deadline);
+
+    static std::string attribute(const std::string &element, const char *name);
+    static std::string member(const std::string &element, const char *tag, const char *name);
+
+private:
+    int fd = -1;
+    std::string buffer;
+};
+
+bool IndiConnection::open(int port, int timeoutMs)
+{
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (Clock::now() < deadline)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return true;
+        }
+        close(fd);
+        fd = -1;
+        usleep(50000);
+    }
+    return false;
+}
+
+bool IndiConnection::send(const std::string &xml)
+{
+    size_t written = 0;
+    while (written < xml.size())
+    {
+        ssize_t n = write(fd, xml.data() + written, xml.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        written += n;
+    }
+    return true;
+}
+
+bool IndiConnection::nextElement(std::string &element, Clock::time_point deadline)
+{
+    for (;;)
+    {
+        // Skip to the next element that carries property values
+        size_t start = buffer.find("<set");
+        size_t def = buffer.find("<def");
+        start = std::min(start, def);
+        if (start != std::string::npos)
+        {
+            size_t nameEnd = buffer.find_first_of(" >", start);
+            if (nameEnd != std::string::npos)
+            {
+                std::string closing = "</" + buffer.substr(start + 1, nameEnd - start - 1) + ">";
+                size_t end = buffer.find(closing, nameEnd);
+                if (end != std::string::npos)
+                {
+                    element = buffer.substr(start, end + closing.size() - start);
+                    buffer.erase(0, end + closing.size());
+                    return true;
+                }
+            }
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        if (remaining <= 0)
+            return false;
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, static_cast<int>(remaining)) <= 0)
+            return false;
+
+        char chunk[65536];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+    }
+}
+
+std::string IndiConnection::attribute(const std::string &element, const char *name)
+{
+    std::string key = std::string(" ") + name + "=\"";
+    size_t tagEnd = element.find('>');
+    size_t start = element.find(key);
+    if (start == std::string::npos || start > tagEnd)
+        return std::string();
+    start += key.size();
+    return element.substr(start, element.find('"', start) - start);
+}
+
+std::string IndiConnection::member(const std::string &element, const char *tag, const char *name)
+{
+    std::string open = std::string("<") + tag + " name=\"" + name + "\"";
+    size_t start = element.find(open);
+    if (start == std::string::npos)
+        return std::string();
+    start = element.find('>', start) + 1;
+    size_t end = element.find("</", start);
+    std::string value = element.substr(start, end - start);
+    value.erase(0, value.find_first_not_of(" \t\r\n"));
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+    return value;
+}
+
+class LatencyBench
+{
+public:
+    explicit LatencyBench(const BenchOptions &options) : options(options) {}
+    ~LatencyBench();
+
+    bool start();
+    bool setCover(bool open, double &microseconds);
+    bool setBrightness(int value, double &microseconds);
+    void stop();
+
+private:
+    bool waitFor(const char *property, const std::string &memberTag, const char *memberName, const std::string &value,
+                 Clock::time_point deadline);
+
+    BenchOptions options;
+    IndiConnection indi;
+    pid_t simulatorPID = -1;
+    pid_t serverPID = -1;
+};
+
+LatencyBench::~LatencyBench()
+{
+    stop();
+}
+
+bool LatencyBench::start()
+{
+    std::string link = "/tmp/flatpanel-bench-" + std::to_string(getpid());
+    std::vector<std::string> simArgs = { options.simulator, "--link", link };
+    for (const std::string &arg : splitArgs(options.simulatorArgs))
+        simArgs.push_back(arg);
+
+    int simOut;
+    simulatorPID = spawn(simArgs, &simOut);
+    char path[256] = {};
+    if (simulatorPID < 0 || read(simOut, path, sizeof(path) - 1) <= 0)
+    {
+        fprintf(stderr, "Simulator did not start\n");
+        return false;
+    }
+    close(simOut);
+
+    serverPID = spawn({ options.indiserver, "-p", std::to_string(options.port), options.driver }, nullptr);
+    if (serverPID < 0 || !indi.open(options.port, options.timeoutMs))
+    {
+        fprintf(stderr, "Could not reach indiserver on port %d\n", options.port);
+        return false;
+    }
+
+    indi.send("<getProperties version=\"1.7\"/>\n");
+    auto deadline = Clock::now() + std::chrono::milliseconds(options.timeoutMs);
+    std::string element;
+    while (indi.nextElement(element, deadline))
+        if (IndiConnection::attribute(element, "name") == "Serial Port")
+            break;
+
+    indi.send(std::string("<newTextVector device=\"") + deviceName + "\" name=\"Serial Port\">"
+              "<oneText name=\"PORT\">" + link + "</oneText></newTextVector>\n");
+    indi.send(std::string("<newSwitchVector device=\"") + deviceName + "\" name=\"CONNECTION\">"
+              "<oneSwitch name=\"CONNECT\">On</oneSwitch><oneSwitch name=\"DISCONNECT\">Off</oneSwitch></newSwitchVector>\n");
+
+    deadline = Clock::now() + std::chrono::milliseconds(options.timeoutMs * 2);
+    if (!waitFor("CONNECTION", "oneSwitch", "CONNECT", "On", deadline))
+    {
+        fprintf(stderr, "Driver did not connect to the simulator at %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+void LatencyBench::stop()
+{
+    for (pid_t *pid : { &serverPID, &simulatorPID })
+    {
+        if (*pid > 0)
+        {
+            kill(*pid, SIGTERM);
+            waitpid(*pid, nullptr, 0);
+            *pid = -1;
+        }
+    }
+}
+
+bool LatencyBench::waitFor(const char *property, const std::string &memberTag, const char *memberName,
+                           const std::string &value, Clock::time_point deadline)
+{
+    std::string element;
+    while (indi.nextElement(element, deadline))
+    {
+        if (IndiConnection::attribute(element, "name") != property || IndiConnection::attribute(element, "state") != "Ok")
+            continue;
+
+        std::string current = IndiConnection::member(element, memberTag.c_str(), memberName);
+        if (current == value || (!current.empty() && !value.empty() && atof(current.c_str()) == atof(value.c_str()) &&
+                                 memberTag == "oneNumber"))
+            return true;
+    }
+    return false;
+}
+
+bool LatencyBench::setCover(bool open, double &microseconds)
+{
+    auto start = Clock::now();
+    indi.send(std::string("<newSwitchVector device=\"") + deviceName + "\" name=\"Cover Control\">"
+              "<oneSwitch name=\"OPEN\">" + (open ? "On" : "Off") + "</oneSwitch>"
+              "<oneSwitch name=\"CLOSE\">" + (open ? "Off" : "On") + "</oneSwitch></newSwitchVector>\n");
+    bool done = waitFor("Cover Control", "oneSwitch", open ? "OPEN" : "CLOSE", "On",
+                        start + std::chrono::milliseconds(options.timeoutMs));
+    microseconds = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    return done;
+}
+
+bool LatencyBench::setBrightness(int value, double &microseconds)
+{
+    auto start = Clock::now();
+    indi.send(std::string("<newNumberVector device=\"") + deviceName + "\" name=\"Brightness Control\">"
+              "<oneNumber name=\"BRIGHTNESS\">" + std::to_string(value) + "</oneNumber></newNumberVector>\n");
+    bool done = waitFor("Brightness Control", "oneNumber", "BRIGHTNESS", std::to_string(value),
+                        start + std::chrono::milliseconds(options.timeoutMs));
+    microseconds = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    return done;
+}
+
+static double percentile(std::vector<double> sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// A JSON string literal, quotes included
+static std::string jsonString(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+            quoted += static_cast<char>(c);
+    }
+    return quoted + '"';
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --driver PATH          driver binary (default indi_flatpanel)\n"
+            "  --simulator PATH       simulator binary (default flatpanel_simulator)\n"
+            "  --indiserver PATH      indiserver binary (default indiserver)\n"
+            "  --sim-args \"ARGS\"      extra simulator options (default \"--motion-ms 0\")\n"
+            "  --port N               indiserver port (default 7625)\n"
+            "  --iterations N         samples per command (default 1000)\n"
+            "  --throughput-seconds N closed-loop throughput run (default 5)\n"
+            "  --json FILE            write machine-readable results\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option longOptions[] =
+    {
+        { "driver", required_argument, nullptr, 'd' },
+        { "simulator", required_argument, nullptr, 's' },
+        { "indiserver", required_argument, nullptr, 'i' },
+        { "sim-args", required_argument, nullptr, 'a' },
+        { "port", required_argument, nullptr, 'p' },
+        { "iterations", required_argument, nullptr, 'n' },
+        { "throughput-seconds", required_argument, nullptr, 't' },
+        { "json", required_argument, nullptr, 'j' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    BenchOptions options;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:s:i:a:p:n:t:j:h", longOptions, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                options.driver = optarg;
+                break;
+            case 's':
+                options.simulator = optarg;
+                break;
+            case 'i':
+                options.indiserver = optarg;
+                break;
+            case 'a':
+                options.simulatorArgs = optarg;
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                break;
+            case 'n':
+                options.iterations = atoi(optarg);
+                break;
+            case 't':
+                options.throughputSeconds = atoi(optarg);
+                break;
+            case 'j':
+                options.json = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // Opened up front so a bad path fails before minutes of measuring
+    FILE *json = nullptr;
+    if (!options.json.empty())
+    {
+        json = fopen(options.json.c_str(), "w");
+        if (json == nullptr)
+        {
+            fprintf(stderr, "Cannot write %s: %s\n", options.json.c_str(), strerror(errno));
+            return 1;
+        }
+    }
+
+    LatencyBench bench(options);
+    if (!bench.start())
+    {
+        if (json != nullptr)
+            fclose(json);
+        return 1;
+    }
+
+    Result opens, closes, brightness;
+    opens.name = "OPEN";
+    closes.name = "CLOSE";
+    brightness.name = "BRIGHTNESS";
+
+    auto record = [](Result &result, bool done, double us)
+    {
+        if (done)
+            result.samples.push_back(us);
+        else
+            result.timeouts++;
+    };
+
+    for (int i = 0; i < options.iterations; ++i)
+    {
+        double us;
+        bool done = bench.setCover(true, us);
+        record(opens, done, us);
+        done = bench.setCover(false, us);
+        record(closes, done, us);
+        // Alternate values so every request is a real change
+        done = bench.setBrightness(1000 + (i % 2), us);
+        record(brightness, done, us);
+    }
+
+    long completed = 0;
+    auto start = Clock::now();
+    auto end = start + std::chrono::seconds(options.throughputSeconds);
+    while (Clock::now() < end)
+    {
+        double us;
+        if (bench.setBrightness(2000 + (completed % 2), us))
+            completed++;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double throughput = completed / seconds;
+
+    bench.stop();
+
+    if (json != nullptr)
+        fprintf(json, "{\n  \"benchmark\": \"flatpanel_e2e\",\n  \"iterations\": %d,\n  \"sim_args\": %s,\n  \"results\": [\n",
+                options.iterations, jsonString(options.simulatorArgs).c_str());
+
+    printf("%-12s %8s %10s %10s %10s %10s %9s\n", "command", "samples", "mean us", "p50 us", "p99 us", "p999 us", "timeouts");
+    Result *results[] = { &opens, &closes, &brightness };
+    for (size_t i = 0; i < 3; ++i)
+    {
+        Result &result = *results[i];
+        std::sort(result.samples.begin(), result.samples.end());
+        double mean = 0;
+        for (double sample : result.samples)
+            mean += sample;
+        mean = result.samples.empty() ? 0 : mean / result.samples.size();
+        double p50 = percentile(result.samples, 0.50), p99 = percentile(result.samples, 0.99),
+               p999 = percentile(result.samples, 0.999);
+
+        printf("%-12s %8zu %10.1f %10.1f %10.1f %10.1f %9d\n", result.name.c_str(), result.samples.size(), mean, p50, p99,
+               p999, result.timeouts);
+        if (json != nullptr)
+            fprintf(json,
+                    "    { \"command\": %s, \"samples\": %zu, \"timeouts\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+                    "\"p99_us\": %.1f, \"p999_us\": %.1f }%s\n",
+                    jsonString(result.name).c_str(), result.samples.size(), result.timeouts, mean, p50, p99, p999, i < 2 ? "," : "");
+    }
+    printf("sustained brightness commands: %.1f/s\n", throughput);
+
+    if (json != nullptr)
+    {
+        fprintf(json, "  ],\n  \"throughput_cmds_per_s\": %.1f\n}\n", throughput);
+        if (fclose(json) != 0)
+        {
+            fprintf(stderr, "Cannot write %s: %s\n", options.json.c_str(), strerror(errno));
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+// Microbenchmarks for the serial protocol layer: response parsing, command
+// encoding and line framing, each measured in isolation.
+//
+//   g++ -std=c++17 -O2 -I.. -o flatpanel_protocol_bench flatpanel_protocol_bench.cpp -lbenchmark -lpthread
+//   ./flatpanel_protocol_bench --benchmark_format=json
+//
+// Parse benchmarks report lines/s, framing benchmarks bytes/s and lines/s.
+// Tagged encoders also report the bytes each command takes on the wire.
+
+#include "flatpanel_protocol.h"
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+// What the firmware sends while a cover moves and a client drags the slider
+const std::vector<std::string> &statusBurst()
+{
+    static const std::vector<std::string> lines =
+    {
+        "STATE MOVING",
+        "#17 OK",
+        "BRIGHTNESS 1024",
+        "#18 OK",
+        "BRIGHTNESS 2048",
+        "#19 OK",
+        "STATE OPEN",
+        "BRIGHTNESS 4095",
+        "#20 OK",
+        "STATE CLOSED",
+    };
+    return lines;
+}
+
+// Lines a noisy link or another device on the port produces
+const std::vector<std::string> &noisyLines()
+{
+    static const std::vector<std::string> lines =
+    {
+        "STATE OP\x8aN",
+        "BRIGHT",
+        "#x OK",
+        "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47",
+        "BRIGHTNESS 12a4",
+        "",
+        "ERR UNKNOWN",
+        "STATE MOVING",
+    };
+    return lines;
+}
+
+std::string joinLines(const std::vector<std::string> &lines, int repeat)
+{
+    std::string stream;
+    for (int i = 0; i < repeat; ++i)
+        for (const std::string &line : lines)
+            stream += line + "\r\n";
+    return stream;
+}
+
+// Random bytes with the occasional newline, including overlong runs
+std::string noiseStream(size_t size)
+{
+    std::mt19937 rng(42);
+    std::string stream(size, '\0');
+    for (char &c : stream)
+    {
+        c = static_cast<char>(rng() & 0xff);
+        if (rng() % 97 == 0)
+            c = '\n';
+    }
+    return stream;
+}
+
+void parseLines(benchmark::State &state, const std::vector<std::string> &lines)
+{
+    std::vector<std::string_view> views(lines.begin(), lines.end());
+    PanelEvent event;
+    for (auto _ : state)
+    {
+        for (std::string_view line : views)
+        {
+            ParseResult parsed = parsePanelResponse(line, event);
+            benchmark::DoNotOptimize(parsed);
+            benchmark::DoNotOptimize(event);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * views.size());
+}
+
+void BM_ParseStatusBurst(benchmark::State &state)
+{
+    parseLines(state, statusBurst());
+}
+BENCHMARK(BM_ParseStatusBurst);
+
+void BM_ParseNoisyLines(benchmark::State &state)
+{
+    parseLines(state, noisyLines());
+}
+BENCHMARK(BM_ParseNoisyLines);
+
+void BM_EncodeBrightness(benchmark::State &state)
+{
+    char buffer[32];
+    int value = 0;
+    for (auto _ : state)
+    {
+        int length = protocol::encode<protocol::SetBrightness>(buffer, sizeof(buffer), value);
+        value = (value + 37) & 4095;
+        benchmark::DoNotOptimize(length);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeBrightness);
+
+void BM_EncodeTagged(benchmark::State &state)
+{
+    char buffer[64];
+    const std::string_view command = "BRIGHTNESS 4095";
+    unsigned sequence = 1;
+    int length = 0;
+    for (auto _ : state)
+    {
+        length = encodeTaggedCommand(buffer, sizeof(buffer), sequence, command);
+        sequence = sequence % 9999 + 1;
+        benchmark::DoNotOptimize(length);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["wire bytes"] = length + 1;
+}
+BENCHMARK(BM_EncodeTagged);
+
+// The same command as a binary frame, from the tagged line the driver queues
+void BM_EncodeBinaryTagged(benchmark::State &state)
+{
+    char line[64];
+    char frame[protocol::binary::MaxFrame];
+    unsigned sequence = 1;
+    int length = 0;
+    for (auto _ : state)
+    {
+        int n = encodeTaggedCommand(line, sizeof(line), sequence, "BRIGHTNESS 4095");
+        length = protocol::binary::encodeFrame<protocol::binary::CommandFrames>(std::string_view(line, n), frame, sizeof(frame));
+        sequence = sequence % 255 + 1;
+        benchmark::DoNotOptimize(length);
+        benchmark::DoNotOptimize(frame);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["wire bytes"] = length;
+}
+BENCHMARK(BM_EncodeBinaryTagged);
+
+// Feeds the stream in read()-sized chunks (range(0) bytes) and drains every line
+void frameStream(benchmark::State &state, const std::string &stream)
+{
+    size_t chunk = static_cast<size_t>(state.range(0));
+    size_t lines = 0;
+    for (auto _ : state)
+    {
+        LineFramer<1024, 256> framer;
+        size_t offset = 0;
+        while (offset < stream.size())
+        {
+            size_t space;
+            char *dest = framer.writeSpace(space);
+            size_t n = std::min({ space, chunk, stream.size() - offset });
+            memcpy(dest, stream.data() + offset, n);
+            framer.commit(n);
+            offset += n;
+
+            std::string_view line;
+            while (framer.nextLine(line))
+            {
+                benchmark::DoNotOptimize(line);
+                lines++;
+            }
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * stream.size());
+    state.counters["lines/s"] = benchmark::Counter(static_cast<double>(lines), benchmark::Counter::kIsRate);
+}
+
+void BM_FrameStatusBurst(benchmark::State &state)
+{
+    static const std::string stream = joinLines(statusBurst(), 100);
+    frameStream(state, stream);
+}
+BENCHMARK(BM_FrameStatusBurst)->Arg(1)->Arg(16)->Arg(256);
+
+void BM_FrameNoise(benchmark::State &state)
+{
+    static const std::string stream = noiseStream(64 * 1024);
+    frameStream(state, stream);
+}
+BENCHMARK(BM_FrameNoise)->Arg(16)->Arg(256);
+
+// Framing plus parsing, as done per wakeup on the I/O thread
+void BM_FrameAndParseStatusBurst(benchmark::State &state)
+{
+    static const std::string stream = joinLines(statusBurst(), 100);
+    size_t lines = 0;
+    for (auto _ : state)
+    {
+        LineFramer<1024, 256> framer;
+        size_t offset = 0;
+        while (offset < stream.size())
+        {
+            size_t space;
+            char *dest = framer.writeSpace(space);
+            size_t n = std::min<size_t>(space, stream.size() - offset);
+            memcpy(dest, stream.data() + offset, n);
+            framer.commit(n);
+            offset += n;
+
+            std::string_view line;
+            PanelEvent event;
+            while (framer.nextLine(line))
+            {
+                ParseResult parsed = parsePanelResponse(line, event);
+                benchmark::DoNotOptimize(parsed);
+                lines++;
+            }
+        }
+    }
+    state.SetItemsProcessed(lines);
+}
+BENCHMARK(BM_FrameAndParseStatusBurst);
+
+// The status burst as binary frames: SLIP framing, CRC check and unpacking
+// before the same parse
+void BM_FrameAndParseBinaryBurst(benchmark::State &state)
+{
+    static const std::string stream = []
+    {
+        std::string frames;
+        char frame[protocol::binary::MaxFrame];
+        for (int i = 0; i < 100; ++i)
+            for (const std::string &line : statusBurst())
+                frames.append(frame, protocol::binary::encodeFrame<protocol::binary::ResponseFrames>(line, frame, sizeof(frame)));
+        return frames;
+    }();
+    size_t lines = 0;
+    for (auto _ : state)
+    {
+        LineFramer<1024, 256> framer;
+        framer.setDelimiter(static_cast<char>(protocol::binary::END));
+        size_t offset = 0;
+        while (offset < stream.size())
+        {
+            size_t space;
+            char *dest = framer.writeSpace(space);
+            size_t n = std::min<size_t>(space, stream.size() - offset);
+            memcpy(dest, stream.data() + offset, n);
+            framer.commit(n);
+            offset += n;
+
+            std::string_view frame, line;
+            char text[128];
+            PanelEvent event;
+            while (framer.nextLine(frame))
+            {
+                if (!protocol::binary::decodeFrame<protocol::binary::ResponseFrames>(frame, text, sizeof(text), line))
+                    continue;
+                ParseResult parsed = parsePanelResponse(line, event);
+                benchmark::DoNotOptimize(parsed);
+                lines++;
+            }
+        }
+    }
+    state.SetItemsProcessed(lines);
+    state.counters["wire bytes/line"] = static_cast<double>(stream.size()) / (100 * statusBurst().size());
+}
+BENCHMARK(BM_FrameAndParseBinaryBurst);
+
+}
+
+BENCHMARK_MAIN();
@@ -0,0 +1,803 @@
+#pragma once
+
+// Line protocol pieces shared by the INDI driver and the panel simulator, and
+// the binary framing both can switch to once the link is up
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+inline bool startsWith(std::string_view text, std::string_view prefix)
+{
+    return text.substr(0, prefix.size()) == prefix;
+}
+
+inline bool endsWith(std::string_view text, std::string_view suffix)
+{
+    return text.size() >= suffix.size() && text.substr(text.size() - suffix.size()) == suffix;
+}
+
+// Fixed-capacity line framer for the serial stream. Every byte is stored twice,
+// at i and i + Capacity, so any buffered line is contiguous and nextLine() can
+// hand it out as a view into the buffer. A view is only valid until the next
+// writeSpace(): the read that follows may reuse those bytes once the buffer
+// wraps, so callers use or copy each line before reading again.
+// A partial line longer than MaxLine is treated as noise: it is dropped and the
+// framer resynchronises on the next delimiter, a newline unless set otherwise.
+template <size_t Capacity, size_t MaxLine>
+class LineFramer
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(MaxLine < Capacity, "MaxLine must leave room in the buffer");
+
+public:
+    // Contiguous free space for the next read()
+    char *writeSpace(size_t &space)
+    {
+        size_t offset = tail & (Capacity - 1);
+        space = std::min(Capacity - (tail - head), Capacity - offset);
+        return buffer + offset;
+    }
+
+    void commit(size_t n)
+    {
+        size_t offset = tail & (Capacity - 1);
+        memcpy(buffer + offset + Capacity, buffer + offset, n);
+        tail += n;
+    }
+
+    bool nextLine(std::string_view &line)
+    {
+        while (scan < tail)
+        {
+            const char *start = buffer + (scan & (Capacity - 1));
+            const char *eol = static_cast<const char *>(memchr(start, delimiter, tail - scan));
+            if (eol == nullptr)
+            {
+                scan = tail;
+                break;
+            }
+
+            size_t end = scan + (eol - start);
+            size_t length = end - head;
+            const char *first = buffer + (head & (Capacity - 1));
+            head = scan = end + 1;
+
+            if (discarding)
+            {
+                discarding = false;
+                droppedBytes += length + 1;
+                continue;
+            }
+
+            if (delimiter == '\n' && length > 0 && first[length - 1] == '\r')
+                --length;
+            line = std::string_view(first, length);
+            return true;
+        }
+
+        if (tail - head > MaxLine)
+        {
+            droppedBytes += tail - head;
+            head = scan = tail;
+            discarding = true;
+        }
+        return false;
+    }
+
+    void reset()
+    {
+        head = tail = scan = 0;
+        discarding = false;
+    }
+
+    // Switches framing mid-stream; bytes after the last line are rescanned
+    void setDelimiter(char byte)
+    {
+        delimiter = byte;
+        scan = head;
+    }
+
+    // Bytes after the last complete line, still waiting for a delimiter; valid
+    // until the next writeSpace() like a line
+    std::string_view pending() const
+    {
+        return std::string_view(buffer + (head & (Capacity - 1)), tail - head);
+    }
+
+    size_t dropped() const
+    {
+        return droppedBytes;
+    }
+
+private:
+    char buffer[2 * Capacity];
+    size_t head = 0;
+    size_t tail = 0;
+    size_t scan = 0;
+    size_t droppedBytes = 0;
+    bool discarding = false;
+    char delimiter = '\n';
+};
+
+// State change reported by the firmware, parsed on the driver's I/O thread and
+// applied to the INDI properties on the main loop.
+struct PanelEvent
+{
+    enum Type
+    {
+        COVER_OPEN,
+        COVER_CLOSED,
+        COVER_MOVING,
+        COVER_HALTED,
+        BRIGHTNESS,
+        COMMAND_ACK,
+        COMMAND_NAK,
+        FIRMWARE_READY,
+        FIRMWARE_ERROR,
+        STATUS
+    } type;
+    int value;
+
+    // STATUS only; value is the cover position (protocol::CoverPositions index)
+    int brightness = 0;
+    bool calibratorOn = false;
+    int progress = 0;
+    unsigned sequence = 0;
+};
+
+enum class ParseResult
+{
+    Event,     // event filled in
+    Reply,     // well-formed handshake reply (ID, BAUDS, BAUD, ECHO, EVENTS, FRAMING), no event
+    Malformed  // unknown keyword or bad arguments
+};
+
+// Whole-token decimal number within [min, max]; no sign, spaces or trailing bytes
+template <typename T>
+inline bool parseProtocolNumber(std::string_view text, T &value, T min, T max)
+{
+    if (text.empty())
+        return false;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size() && value >= min && value <= max;
+}
+
+// Compile-time description of the line protocol. Each message is a keyword and
+// a list of typed fields; encode<Message>() and decode<Message>() are generated
+// from it, and MessageSet dispatches a line to the matching message without
+// any hand-written parsing. Adding a command means adding one struct here.
+namespace protocol
+{
+
+inline bool copyText(char *&out, char *end, std::string_view text)
+{
+    if (static_cast<size_t>(end - out) < text.size())
+        return false;
+    out = std::copy(text.begin(), text.end(), out);
+    return true;
+}
+
+// Decimal integer restricted to [Min, Max]. In binary frames it is big-endian
+// in as few bytes as Max needs, so a brightness is 12 bits in two bytes.
+template <int Min, int Max>
+struct Int
+{
+    static_assert(Min >= 0, "binary form is unsigned");
+    using value_type = int;
+    static constexpr size_t bytes = Max <= 0xff ? 1 : Max <= 0xffff ? 2 : 3;
+
+    static bool decode(std::string_view text, int &value)
+    {
+        return parseProtocolNumber(text, value, Min, Max);
+    }
+
+    static bool encode(char *&out, char *end, int value)
+    {
+        if (value < Min || value > Max)
+            return false;
+        auto [next, error] = std::to_chars(out, end, value);
+        if (error != std::errc())
+            return false;
+        out = next;
+        return true;
+    }
+
+    static bool pack(unsigned char *&out, unsigned char *end, int value)
+    {
+        if (value < Min || value > Max || static_cast<size_t>(end - out) < bytes)
+            return false;
+        for (size_t i = bytes; i-- > 0;)
+            *out++ = static_cast<unsigned char>(value >> (8 * i));
+        return true;
+    }
+
+    static bool unpack(const unsigned char *&in, const unsigned char *end, int &value)
+    {
+        if (static_cast<size_t>(end - in) < bytes)
+            return false;
+        value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value = value << 8 | *in++;
+        return value >= Min && value <= Max;
+    }
+};
+
+// One of a fixed set of words, carried as its index in Names::values
+template <typename Names>
+struct Enum
+{
+    using value_type = int;
+
+    static bool decode(std::string_view text, int &value)
+    {
+        for (size_t i = 0; i < std::size(Names::values); ++i)
+        {
+            if (Names::values[i] == text)
+            {
+                value = static_cast<int>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool encode(char *&out, char *end, int value)
+    {
+        if (value < 0 || static_cast<size_t>(value) >= std::size(Names::values))
+            return false;
+        return copyText(out, end, Names::values[value]);
+    }
+
+    static bool pack(unsigned char *&out, unsigned char *end, int value)
+    {
+        if (value < 0 || static_cast<size_t>(value) >= std::size(Names::values) || out == end)
+            return false;
+        *out++ = static_cast<unsigned char>(value);
+        return true;
+    }
+
+    static bool unpack(const unsigned char *&in, const unsigned char *end, int &value)
+    {
+        if (in == end || *in >= std::size(Names::values))
+            return false;
+        value = *in++;
+        return true;
+    }
+};
+
+// Rest of the line, spaces included; only valid as the last field
+template <bool AllowEmpty = false>
+struct Text
+{
+    using value_type = std::string_view;
+    static constexpr bool rest = true;
+
+    static bool decode(std::string_view text, std::string_view &value)
+    {
+        value = text;
+        return AllowEmpty || !text.empty();
+    }
+
+    static bool encode(char *&out, char *end, std::string_view value)
+    {
+        return copyText(out, end, value);
+    }
+
+    // Not carried in binary frames; an optional text arrives empty
+    static bool pack(unsigned char *&, unsigned char *, std::string_view)
+    {
+        return AllowEmpty;
+    }
+
+    static bool unpack(const unsigned char *&, const unsigned char *, std::string_view &value)
+    {
+        value = std::string_view();
+        return AllowEmpty;
+    }
+};
+
+template <typename Field, typename = void>
+struct TakesRest : std::false_type {};
+
+template <typename Field>
+struct TakesRest<Field, std::void_t<decltype(Field::rest)>> : std::true_type {};
+
+template <typename... Items>
+struct Fields
+{
+    static constexpr size_t count = sizeof...(Items);
+    using Types = std::tuple<Items...>;
+    using Values = std::tuple<typename Items::value_type...>;
+};
+
+struct CoverPositions
+{
+    static constexpr std::string_view values[] = { "OPEN", "CLOSED", "MOVING", "HALTED" };
+};
+
+struct OnOff
+{
+    static constexpr std::string_view values[] = { "OFF", "ON" };
+};
+
+struct Framings
+{
+    static constexpr std::string_view values[] = { "ASCII", "BINARY" };
+};
+
+// Driver to firmware
+struct Open : Fields<> { static constexpr std::string_view keyword = "OPEN"; };
+struct Close : Fields<> { static constexpr std::string_view keyword = "CLOSE"; };
+struct Halt : Fields<> { static constexpr std::string_view keyword = "HALT"; };
+struct QueryState : Fields<> { static constexpr std::string_view keyword = "STATE"; };
+struct SetBrightness : Fields<Int<0, 4095>> { static constexpr std::string_view keyword = "BRIGHTNESS"; };
+struct Identify : Fields<> { static constexpr std::string_view keyword = "ID"; };
+struct Ping : Fields<> { static constexpr std::string_view keyword = "PING"; };
+struct QueryBauds : Fields<> { static constexpr std::string_view keyword = "BAUDS"; };
+struct SetBaud : Fields<Int<9600, 500000>> { static constexpr std::string_view keyword = "BAUD"; };
+struct Echo : Fields<Text<>> { static constexpr std::string_view keyword = "ECHO"; };
+struct QueryStatus : Fields<> { static constexpr std::string_view keyword = "STATUS"; };
+// EVENTS ON: the firmware sends STATE and BRIGHTNESS by itself whenever they
+// change, or a STATUS line per change if it implements STATUS
+struct SetEvents : Fields<Enum<OnOff>> { static constexpr std::string_view keyword = "EVENTS"; };
+// FRAMING BINARY: answered in the old framing, then both ends switch (see binary below)
+struct SetFraming : Fields<Enum<Framings>> { static constexpr std::string_view keyword = "FRAMING"; };
+
+// Firmware to driver
+struct StateReport : Fields<Enum<CoverPositions>> { static constexpr std::string_view keyword = "STATE"; };
+struct BrightnessReport : Fields<Int<0, 4095>> { static constexpr std::string_view keyword = "BRIGHTNESS"; };
+struct Ready : Fields<> { static constexpr std::string_view keyword = "READY"; };
+struct Error : Fields<Text<true>> { static constexpr std::string_view keyword = "ERR"; };
+struct IdentityReply : Fields<Text<>> { static constexpr std::string_view keyword = "ID"; };
+struct BaudsReply : Fields<Text<>> { static constexpr std::string_view keyword = "BAUDS"; };
+struct BaudReply : Fields<Int<9600, 500000>> { static constexpr std::string_view keyword = "BAUD"; };
+struct EchoReply : Fields<Text<>> { static constexpr std::string_view keyword = "ECHO"; };
+struct EventsReply : Fields<Enum<OnOff>> { static constexpr std::string_view keyword = "EVENTS"; };
+struct FramingReply : Fields<Enum<Framings>> { static constexpr std::string_view keyword = "FRAMING"; };
+// STATUS <cover> <brightness> <calibrator> <progress %> <sequence>; the sequence
+// counts state changes in the firmware and wraps at 65536
+struct StatusReport : Fields<Enum<CoverPositions>, Int<0, 4095>, Enum<OnOff>, Int<0, 100>, Int<0, 65535>>
+{
+    static constexpr std::string_view keyword = "STATUS";
+};
+
+namespace detail
+{
+
+template <typename Types, typename Args, size_t... I>
+bool encodeFields(char *&out, char *end, const Args &args, std::index_sequence<I...>)
+{
+    bool ok = true;
+    ((ok = ok && out < end && (*out++ = ' ', true) &&
+           std::tuple_element_t<I, Types>::encode(out, end, std::get<I>(args))), ...);
+    return ok;
+}
+
+template <typename Types, typename Values, size_t... I>
+bool decodeFields(std::string_view arguments, Values &values, std::index_sequence<I...>)
+{
+    bool ok = true;
+    auto next = [&](auto field, auto &value)
+    {
+        using Field = decltype(field);
+        std::string_view token = arguments;
+        if constexpr (!TakesRest<Field>::value)
+        {
+            size_t space = arguments.find(' ');
+            token = arguments.substr(0, space);
+            arguments = space == std::string_view::npos ? std::string_view() : arguments.substr(space + 1);
+        }
+        else
+            arguments = std::string_view();
+        return Field::decode(token, value);
+    };
+    (void)next;  // unused for field-less messages
+    ((ok = ok && next(std::tuple_element_t<I, Types>(), std::get<I>(values))), ...);
+    return ok && arguments.empty();
+}
+
+template <typename Types, typename Values, size_t... I>
+bool packFields(unsigned char *&out, unsigned char *end, const Values &values, std::index_sequence<I...>)
+{
+    bool ok = true;
+    ((ok = ok && std::tuple_element_t<I, Types>::pack(out, end, std::get<I>(values))), ...);
+    (void)end;
+    (void)values;
+    return ok;
+}
+
+template <typename Types, typename Values, size_t... I>
+bool unpackFields(const unsigned char *&in, const unsigned char *end, Values &values, std::index_sequence<I...>)
+{
+    bool ok = true;
+    ((ok = ok && std::tuple_element_t<I, Types>::unpack(in, end, std::get<I>(values))), ...);
+    (void)values;
+    return ok && in == end;
+}
+
+}
+
+// Writes "<keyword>[ <field>...]" and a NUL. Returns the length, or -1 if a
+// value is out of range or the buffer is too small.
+template <typename Message, typename... Args>
+int encode(char *buffer, size_t size, const Args &...args)
+{
+    static_assert(sizeof...(Args) == Message::count, "wrong number of fields for message");
+    if (size == 0)
+        return -1;
+
+    char *out = buffer;
+    char *end = buffer + size - 1;
+    if (!copyText(out, end, Message::keyword) ||
+            !detail::encodeFields<typename Message::Types>(out, end, std::forward_as_tuple(args...),
+                    std::make_index_sequence<Message::count>()))
+        return -1;
+    *out = '\0';
+    return static_cast<int>(out - buffer);
+}
+
+// Field-less commands are just their keyword
+template <typename Message>
+constexpr std::string_view command()
+{
+    static_assert(Message::count == 0, "message has fields, use encode()");
+    return Message::keyword;
+}
+
+// Decodes the text after the keyword into Message::Values
+template <typename Message>
+bool decode(std::string_view arguments, typename Message::Values &values)
+{
+    return detail::decodeFields<typename Message::Types>(arguments, values, std::make_index_sequence<Message::count>());
+}
+
+// Splits off the first token and hands the decoded fields of the message with
+// that keyword to visitor(Message(), values). The keyword search is over a
+// constexpr table and the call is resolved at compile time per message.
+template <typename... Messages>
+struct MessageSet
+{
+    static constexpr std::string_view keywords[] = { Messages::keyword... };
+
+    static constexpr size_t find(std::string_view token)
+    {
+        for (size_t i = 0; i < sizeof...(Messages); ++i)
+            if (keywords[i] == token)
+                return i;
+        return sizeof...(Messages);
+    }
+
+    template <typename Result, typename Visitor>
+    static Result visit(std::string_view line, Result unknown, Visitor &&visitor)
+    {
+        size_t space = line.find(' ');
+        size_t index = find(line.substr(0, space));
+        std::string_view arguments = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+
+        Result result = unknown;
+        size_t i = 0;
+        ((i++ == index ? (result = dispatch<Messages>(arguments, unknown, visitor), true) : false) || ...);
+        return result;
+    }
+
+private:
+    template <typename Message, typename Result, typename Visitor>
+    static Result dispatch(std::string_view arguments, Result unknown, Visitor &visitor)
+    {
+        typename Message::Values values;
+        if (!decode<Message>(arguments, values))
+            return unknown;
+        return visitor(Message(), values);
+    }
+};
+
+using Responses = MessageSet<StateReport, BrightnessReport, Ready, Error, IdentityReply, BaudsReply, BaudReply, EchoReply,
+      EventsReply, StatusReport, FramingReply>;
+using Commands = MessageSet<Open, Close, Halt, QueryState, SetBrightness, Identify, Ping, QueryBauds, SetBaud, Echo,
+      SetEvents, QueryStatus, SetFraming>;
+
+static_assert(Responses::find("BAUD") == 6, "BAUD must not match BAUDS");
+static_assert(Commands::find("STATE") == 3, "command table out of order");
+
+}
+
+// Event for each protocol::CoverPositions index
+constexpr PanelEvent::Type coverPositionEvents[] =
+{
+    PanelEvent::COVER_OPEN, PanelEvent::COVER_CLOSED, PanelEvent::COVER_MOVING, PanelEvent::COVER_HALTED
+};
+static_assert(std::size(coverPositionEvents) == std::size(protocol::CoverPositions::values), "cover position table mismatch");
+
+// Parses one framed line from the firmware: "#<seq>" acknowledgements first,
+// then everything else through the generated response decoder. Never allocates.
+inline ParseResult parsePanelResponse(std::string_view response, PanelEvent &event)
+{
+    if (startsWith(response, "#"))
+    {
+        size_t space = response.find(' ');
+        std::string_view arguments = space == std::string_view::npos ? std::string_view() : response.substr(space + 1);
+        unsigned sequence;
+        if (!parseProtocolNumber(response.substr(1, space - 1), sequence, 0u, 65535u))
+            return ParseResult::Malformed;
+        if (arguments == "OK")
+            event = { PanelEvent::COMMAND_ACK, static_cast<int>(sequence) };
+        else if (arguments == "ERR" || startsWith(arguments, "ERR "))
+            event = { PanelEvent::COMMAND_NAK, static_cast<int>(sequence) };
+        else
+            return ParseResult::Malformed;
+        return ParseResult::Event;
+    }
+
+    using namespace protocol;
+    return Responses::visit(response, ParseResult::Malformed, [&event](auto message, const auto &values)
+    {
+        using Message = decltype(message);
+        if constexpr (std::is_same_v<Message, StateReport>)
+            event = { coverPositionEvents[std::get<0>(values)], 0 };
+        else if constexpr (std::is_same_v<Message, BrightnessReport>)
+            event = { PanelEvent::BRIGHTNESS, std::get<0>(values) };
+        else if constexpr (std::is_same_v<Message, Ready>)
+            event = { PanelEvent::FIRMWARE_READY, 0 };
+        else if constexpr (std::is_same_v<Message, Error>)
+            event = { PanelEvent::FIRMWARE_ERROR, 0 };
+        else if constexpr (std::is_same_v<Message, StatusReport>)
+        {
+            event = { PanelEvent::STATUS, std::get<0>(values) };
+            event.brightness = std::get<1>(values);
+            event.calibratorOn = std::get<2>(values) == 1;
+            event.progress = std::get<3>(values);
+            event.sequence = static_cast<unsigned>(std::get<4>(values));
+        }
+        else
+            return ParseResult::Reply;
+        return ParseResult::Event;
+    });
+}
+
+// "#<seq> <cmd>", answered by "#<seq> OK" or "#<seq> ERR ..."
+inline int encodeTaggedCommand(char *buffer, size_t size, unsigned sequence, std::string_view command)
+{
+    if (size < 2)
+        return -1;
+    char *out = buffer;
+    char *end = buffer + size - 1;
+    *out++ = '#';
+    auto [next, error] = std::to_chars(out, end, sequence);
+    if (error != std::errc() || static_cast<size_t>(end - next) < command.size() + 1)
+        return -1;
+    out = next;
+    *out++ = ' ';
+    out = std::copy(command.begin(), command.end(), out);
+    *out = '\0';
+    return static_cast<int>(out - buffer);
+}
+
+namespace protocol
+{
+
+// Binary framing, switched to with FRAMING BINARY once the handshake is done.
+// Each line of the text protocol becomes one packet:
+//   <opcode> [<tag>] <fields...> <crc>
+// Bit 7 of the opcode marks a tagged packet, whose tag byte is the "#<seq>" of
+// the line (so 0-255 here). Fields are packed by their types above and the CRC
+// is CRC-8 (polynomial 0x07) over the bytes before it. Packets are SLIP framed:
+// END closes each one, END and ESC inside are escaped. "#42 BRIGHTNESS 4095\n"
+// is 20 bytes as text and 6 as a frame.
+//
+// Frames map one to one onto lines, so both ends keep their line dispatch and
+// only translate at the wire: encodeFrame() turns a line into a frame and
+// decodeFrame() a frame back into its line. A frame with a bad CRC, escape,
+// opcode or length is rejected, never guessed at. Handshake-only messages (ID,
+// BAUDS, BAUD, ECHO) have no binary form. The firmware is back to text after a
+// reset or FRAMING ASCII, and on its own if no valid frame arrives within one
+// second of the switch.
+namespace binary
+{
+
+constexpr unsigned char END = 0xC0;
+constexpr unsigned char ESC = 0xDB;
+constexpr unsigned char ESC_END = 0xDC;
+constexpr unsigned char ESC_ESC = 0xDD;
+
+constexpr unsigned char TAGGED = 0x80;
+// "#<seq> OK" and "#<seq> ERR ..."; the error text is not carried
+constexpr unsigned char ACK = 0x7E;
+constexpr unsigned char NAK = 0x7F;
+
+// Unescaped packet; a frame is at most twice that plus END
+constexpr size_t MaxPacket = 16;
+constexpr size_t MaxFrame = 2 * MaxPacket + 1;
+
+inline unsigned char crc8(const unsigned char *data, size_t length)
+{
+    unsigned char crc = 0;
+    while (length-- > 0)
+    {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = static_cast<unsigned char>(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    return crc;
+}
+
+// Messages with a binary form; the opcode is First plus the position in the
+// list, so new messages only ever go at the end
+template <unsigned char First, typename... Messages>
+struct FrameSet : MessageSet<Messages...>
+{
+    static_assert(First + sizeof...(Messages) <= ACK, "opcodes run into ACK");
+
+    template <typename Message>
+    static constexpr unsigned char opcode()
+    {
+        constexpr bool matches[] = { std::is_same_v<Message, Messages>... };
+        for (size_t i = 0; i < sizeof...(Messages); ++i)
+            if (matches[i])
+                return static_cast<unsigned char>(First + i);
+        return 0;
+    }
+
+    // Calls visitor(Message()) for the message with that opcode
+    template <typename Visitor>
+    static bool visitOpcode(unsigned char opcode, Visitor &&visitor)
+    {
+        if (opcode < First || opcode >= First + sizeof...(Messages))
+            return false;
+        size_t index = opcode - First;
+        size_t i = 0;
+        bool result = false;
+        ((i++ == index ? (result = visitor(Messages()), true) : false) || ...);
+        return result;
+    }
+};
+
+using CommandFrames = FrameSet<0x01, Open, Close, Halt, QueryState, SetBrightness, Ping, QueryStatus, SetEvents, SetFraming>;
+using ResponseFrames = FrameSet<0x41, StateReport, BrightnessReport, Ready, Error, EventsReply, StatusReport, FramingReply>;
+
+static_assert(CommandFrames::opcode<SetBrightness>() == 0x05, "command opcodes must not move");
+static_assert(ResponseFrames::opcode<StatusReport>() == 0x46, "response opcodes must not move");
+
+inline int slipEncode(const unsigned char *packet, size_t length, char *buffer, size_t size)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char byte = packet[i];
+        bool escape = byte == END || byte == ESC;
+        if (n + (escape ? 2 : 1) >= size)
+            return -1;
+        if (escape)
+        {
+            buffer[n++] = static_cast<char>(ESC);
+            byte = byte == END ? ESC_END : ESC_ESC;
+        }
+        buffer[n++] = static_cast<char>(byte);
+    }
+    if (n >= size)
+        return -1;
+    buffer[n++] = static_cast<char>(END);
+    return static_cast<int>(n);
+}
+
+// Encodes a line, "#<seq> " tagged or not, as a frame ending in END. Returns the
+// frame length, or -1 if the line has no binary form or does not fit.
+template <typename Frames>
+int encodeFrame(std::string_view line, char *buffer, size_t size)
+{
+    unsigned char packet[MaxPacket];
+    unsigned char *out = packet + 1;
+    unsigned char *end = packet + MaxPacket - 1;  // room for the CRC
+
+    bool tagged = startsWith(line, "#");
+    if (tagged)
+    {
+        size_t space = line.find(' ');
+        unsigned sequence;
+        if (space == std::string_view::npos || !parseProtocolNumber(line.substr(1, space - 1), sequence, 0u, 255u))
+            return -1;
+        *out++ = static_cast<unsigned char>(sequence);
+        line = line.substr(space + 1);
+    }
+
+    unsigned char opcode;
+    if (tagged && line == "OK")
+        opcode = ACK;
+    else if (tagged && (line == "ERR" || startsWith(line, "ERR ")))
+        opcode = NAK;
+    else
+        opcode = Frames::visit(line, static_cast<unsigned char>(0), [&](auto message, const auto &values)
+        {
+            using Message = decltype(message);
+            if (!detail::packFields<typename Message::Types>(out, end, values, std::make_index_sequence<Message::count>()))
+                return static_cast<unsigned char>(0);
+            return Frames::template opcode<Message>();
+        });
+    if (opcode == 0)
+        return -1;
+
+    packet[0] = tagged ? opcode | TAGGED : opcode;
+    size_t length = out - packet;
+    packet[length] = crc8(packet, length);
+    return slipEncode(packet, length + 1, buffer, size);
+}
+
+// Checks one frame, as split off at END, and writes its line to buffer. False
+// for a bad escape, CRC, opcode or length; nothing from such a frame is used.
+template <typename Frames>
+bool decodeFrame(std::string_view frame, char *buffer, size_t size, std::string_view &line)
+{
+    unsigned char packet[MaxPacket];
+    size_t length = 0;
+    for (size_t i = 0; i < frame.size(); ++i)
+    {
+        unsigned char byte = static_cast<unsigned char>(frame[i]);
+        if (byte == ESC)
+        {
+            unsigned char next = ++i < frame.size() ? static_cast<unsigned char>(frame[i]) : 0;
+            if (next != ESC_END && next != ESC_ESC)
+                return false;
+            byte = next == ESC_END ? END : ESC;
+        }
+        if (length == MaxPacket)
+            return false;
+        packet[length++] = byte;
+    }
+    if (length < 2 || size < 8 || crc8(packet, length - 1) != packet[length - 1])
+        return false;
+
+    const unsigned char *in = packet + 1;
+    const unsigned char *end = packet + length - 1;
+    char *out = buffer;
+    unsigned char opcode = packet[0] & ~TAGGED;
+    bool tagged = packet[0] & TAGGED;
+    if (tagged)
+    {
+        if (in == end)
+            return false;
+        *out++ = '#';
+        out = std::to_chars(out, buffer + size, static_cast<unsigned>(*in++)).ptr;
+        *out++ = ' ';
+    }
+
+    int written = -1;
+    if (opcode == ACK || opcode == NAK)
+    {
+        if (!tagged || in != end)
+            return false;
+        std::string_view reply = opcode == ACK ? "OK" : "ERR";
+        written = static_cast<int>(reply.size());
+        std::copy(reply.begin(), reply.end(), out);
+    }
+    else
+        Frames::visitOpcode(opcode, [&](auto message)
+        {
+            using Message = decltype(message);
+            typename Message::Values values;
+            if (!detail::unpackFields<typename Message::Types>(in, end, values, std::make_index_sequence<Message::count>()))
+                return false;
+            written = std::apply([&](const auto &...args)
+            {
+                return encode<Message>(out, buffer + size - out, args...);
+            }, values);
+            return written >= 0;
+        });
+    if (written < 0)
+        return false;
+
+    line = std::string_view(buffer, out - buffer + written);
+    return true;
+}
+
+}
+
+}
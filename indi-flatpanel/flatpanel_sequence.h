@@ -0,0 +1,212 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <string>
+#include <utility>
+
+// A multi-step panel operation such as "close, wait for CLOSED, set the
+// brightness, wait for the ack", written as a C++20 coroutine instead of state
+// kept by hand in timer callbacks:
+//
+//     PanelSequence::Body FlatPanelCover::flatCalibration()
+//     {
+//         co_await coverStep(1);
+//         co_await brightnessStep(level);
+//     }
+//
+// Each awaited step starts something and is then polled until it reports done
+// or failed, or its timeout passes; only a step that is done resumes the body.
+// Nothing blocks and no thread is involved: the driver calls advance() after
+// every pass of the event loop and when the earliest deadline is due, so any
+// number of sequences run alongside each other and alongside property handling.
+class PanelSequence
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum Progress
+    {
+        PENDING,
+        DONE,
+        FAILED
+    };
+
+    enum Outcome
+    {
+        RUNNING,
+        COMPLETED,
+        ABORTED
+    };
+
+    // What a sequence body awaits. It lives in the coroutine frame while the
+    // body is suspended on it.
+    struct Step
+    {
+        std::string label;
+        // Sends the command; false when it could not even be queued
+        std::function<bool()> start;
+        std::function<Progress()> poll;
+        std::chrono::milliseconds timeout;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            handle.promise().step = this;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // The coroutine a sequence runs. It starts suspended, so nothing is sent
+    // before the first advance(), and it is never resumed after a failed,
+    // timed out or cancelled step: the frame is destroyed with the sequence.
+    class Body
+    {
+    public:
+        struct promise_type
+        {
+            Step *step = nullptr;
+
+            Body get_return_object()
+            {
+                return Body(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+            void return_void() {}
+            // The driver is built without exceptions in mind; a throwing step is a bug
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+
+        Body(Body &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+        Body &operator=(Body &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (handle)
+                    handle.destroy();
+                handle = std::exchange(other.handle, nullptr);
+            }
+            return *this;
+        }
+        ~Body()
+        {
+            if (handle)
+                handle.destroy();
+        }
+
+    private:
+        friend class PanelSequence;
+        explicit Body(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Called once when the sequence completes, fails, times out or is cancelled
+    using Finished = std::function<void(bool success, const std::string &error)>;
+
+    PanelSequence(std::string name, Body body, Finished finished)
+        : sequenceName(std::move(name)), body(std::move(body)), finished(std::move(finished)) {}
+
+    const std::string &name() const
+    {
+        return sequenceName;
+    }
+
+    // Resumes the body for as many steps as are already satisfied; stops at
+    // the first pending one
+    Outcome advance(Clock::time_point now)
+    {
+        if (outcome != RUNNING)
+            return outcome;
+
+        Body::promise_type &promise = body.handle.promise();
+        while (true)
+        {
+            if (Step *step = promise.step)
+            {
+                if (!started)
+                {
+                    started = true;
+                    stepDeadline = now + step->timeout;
+                    if (!step->start())
+                        return abort(step->label + " could not be sent");
+                }
+
+                Progress progress = step->poll();
+                if (progress == FAILED)
+                    return abort(step->label + " failed");
+                if (progress == PENDING)
+                {
+                    if (now < stepDeadline)
+                        return RUNNING;
+                    return abort(step->label + " timed out after " + std::to_string(step->timeout.count()) + " ms");
+                }
+
+                promise.step = nullptr;
+                started = false;
+            }
+
+            // Runs to the next co_await, or to the end of the body
+            body.handle.resume();
+            if (body.handle.done())
+                break;
+        }
+
+        outcome = COMPLETED;
+        finish(true, std::string());
+        return outcome;
+    }
+
+    // The step in progress is left to finish on its own; the body is not resumed
+    void cancel(const std::string &reason)
+    {
+        if (outcome == RUNNING)
+            abort(reason);
+    }
+
+    Clock::time_point deadline() const
+    {
+        return stepDeadline;
+    }
+
+private:
+    Outcome abort(const std::string &reason)
+    {
+        outcome = ABORTED;
+        finish(false, reason);
+        return outcome;
+    }
+
+    void finish(bool success, const std::string &error)
+    {
+        if (finished)
+        {
+            Finished callback = std::move(finished);
+            finished = nullptr;
+            callback(success, error);
+        }
+    }
+
+    std::string sequenceName;
+    Body body;
+    Finished finished;
+    Outcome outcome = RUNNING;
+    bool started = false;
+    Clock::time_point stepDeadline;
+};
@@ -0,0 +1,794 @@
+// Flat panel firmware simulator.
+//
+// Presents a pseudo-terminal that speaks the panel's serial line protocol so the
+// INDI driver can be connected, exercised and benchmarked without an Arduino.
+// Point the driver's "Serial Port" property at the printed path (or at --link).
+//
+// With --listen it serves a TCP port or Unix socket instead, for the driver's
+// network transports; each accepted connection counts as opening the port.
+//
+// Unless --legacy, it also speaks the binary framing (FRAMING BINARY). Frames
+// that fail their CRC, e.g. under --corrupt-rate, are dropped and counted.
+//
+//   g++ -std=c++17 -O2 -o flatpanel_simulator flatpanel_simulator.cpp -lutil
+
+#include "flatpanel_protocol.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static volatile sig_atomic_t running = 1;
+
+static void handleSignal(int)
+{
+    running = 0;
+}
+
+struct SimulatorOptions
+{
+    int motionMs = 3000;
+    int bootMs = 2000;
+    int byteDelayUs = 0;
+    int jitterUs = 0;
+    double dropRate = 0;
+    double corruptRate = 0;
+    bool resetOnOpen = false;
+    bool legacy = false;
+    bool modelBaud = true;
+    bool verbose = false;
+    std::string link;
+    std::string listen;
+};
+
+class PanelSimulator
+{
+public:
+    PanelSimulator(int master, int listener, const SimulatorOptions &options) : master(master), listener(listener), options(options),
+        rng(std::random_device()()) {}
+
+    void run();
+
+private:
+    // Same order as protocol::CoverPositions
+    enum Cover
+    {
+        OPEN,
+        CLOSED,
+        MOVING,
+        HALTED
+    };
+
+    struct TimedByte
+    {
+        Clock::time_point due;
+        char byte;
+    };
+
+    void onSlaveOpened();
+    void receive(const char *data, size_t n);
+    void handleLine(std::string_view line);
+    void handleFrame(std::string_view frame);
+    void setFraming(bool binary);
+    std::string execute(std::string_view command, bool &known);
+    template <typename Message, typename... Args>
+    static std::string encode(const Args &...args);
+    void reply(const std::string &line);
+    void flushOutput();
+    void finishMotion();
+    void stateChanged();
+    void announceChanges();
+    int progress() const;
+    std::string statusLine() const;
+    Clock::time_point nextDeadline() const;
+    std::chrono::microseconds byteTime();
+    bool damage(char &byte);
+
+    // pty master, or the accepted connection when listening
+    int master;
+    int listener;
+    SimulatorOptions options;
+    std::mt19937 rng;
+
+    bool slaveOpen = false;
+    bool booting = false;
+    Clock::time_point bootDone;
+
+    Cover cover = CLOSED;
+    Cover target = CLOSED;
+    Clock::time_point motionStart;
+    Clock::time_point motionDone;
+    int haltedProgress = 0;
+    int brightness = 0;
+
+    // STATUS sequence: one step per state change, pushed changes are announced
+    // after the reply to the command that caused them
+    unsigned statusSequence = 0;
+    bool changePending = false;
+
+    // Unsolicited STATE/BRIGHTNESS on change, off after every reset
+    bool pushEvents = false;
+
+    int baud = 9600;
+    int pendingBaud = 0;
+    Clock::time_point baudRevert;
+
+    // Binary frames after FRAMING BINARY; the switch waits for the reply, like BAUD
+    bool binaryFrames = false;
+    int pendingFraming = -1;
+    Clock::time_point framingRevert;
+    unsigned badFrames = 0;
+
+    std::deque<TimedByte> inbound;
+    std::deque<TimedByte> outbound;
+    Clock::time_point lastInbound;
+    Clock::time_point lastOutbound;
+    LineFramer<1024, 256> framer;
+};
+
+// Time one byte occupies on the wire (10 bits at the current rate) plus the
+// configured extra delay and jitter.
+std::chrono::microseconds PanelSimulator::byteTime()
+{
+    long us = options.byteDelayUs;
+    if (options.modelBaud)
+        us += 10000000L / baud;
+    if (options.jitterUs > 0)
+        us += std::uniform_int_distribution<int>(0, options.jitterUs)(rng);
+    return std::chrono::microseconds(us);
+}
+
+// Returns false if the byte is lost on the wire
+bool PanelSimulator::damage(char &byte)
+{
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    if (options.dropRate > 0 && chance(rng) < options.dropRate)
+        return false;
+    if (options.corruptRate > 0 && chance(rng) < options.corruptRate)
+        byte ^= static_cast<char>(1 << std::uniform_int_distribution<int>(0, 7)(rng));
+    return true;
+}
+
+void PanelSimulator::onSlaveOpened()
+{
+    if (options.verbose)
+        fprintf(stderr, "sim: port opened\n");
+
+    // Every session starts as text, as it would after the firmware's reset on open
+    setFraming(false);
+    pendingFraming = -1;
+
+    if (!options.resetOnOpen)
+        return;
+
+    // Like an Arduino on DTR: reboot into the bootloader, come back at 9600 and
+    // announce readiness. Brightness is volatile, the cover stays where it is.
+    booting = true;
+    bootDone = Clock::now() + std::chrono::milliseconds(options.bootMs);
+    inbound.clear();
+    outbound.clear();
+    framer.reset();
+    baud = 9600;
+    pendingBaud = 0;
+    pushEvents = false;
+    brightness = 0;
+    if (cover == MOVING)
+    {
+        haltedProgress = progress();
+        cover = HALTED;
+    }
+    statusSequence++;
+    changePending = false;
+}
+
+void PanelSimulator::receive(const char *data, size_t n)
+{
+    auto now = Clock::now();
+    for (size_t i = 0; i < n; ++i)
+    {
+        char byte = data[i];
+        if (!damage(byte))
+            continue;
+        lastInbound = std::max(lastInbound, now) + byteTime();
+        inbound.push_back({ lastInbound, byte });
+    }
+}
+
+void PanelSimulator::reply(const std::string &line)
+{
+    if (options.verbose)
+        fprintf(stderr, "sim: -> %s\n", line.c_str());
+
+    std::string bytes = line + "\n";
+    if (binaryFrames)
+    {
+        char frame[protocol::binary::MaxFrame];
+        int length = protocol::binary::encodeFrame<protocol::binary::ResponseFrames>(line, frame, sizeof(frame));
+        if (length < 0)
+        {
+            if (options.verbose)
+                fprintf(stderr, "sim: no binary form for '%s', not sent\n", line.c_str());
+            return;
+        }
+        bytes.assign(frame, length);
+    }
+
+    auto now = Clock::now();
+    for (char byte : bytes)
+    {
+        if (!damage(byte))
+            continue;
+        lastOutbound = std::max(lastOutbound, now) + byteTime();
+        outbound.push_back({ lastOutbound, byte });
+    }
+}
+
+template <typename Message, typename... Args>
+std::string PanelSimulator::encode(const Args &...args)
+{
+    char line[64];
+    int length = protocol::encode<Message>(line, sizeof(line), args...);
+    return length < 0 ? std::string("ERR OVERFLOW") : std::string(line, length);
+}
+
+std::string PanelSimulator::execute(std::string_view command, bool &known)
+{
+    using namespace protocol;
+    known = false;
+
+    std::string response = Commands::visit(command, std::string(), [&](auto message, const auto &values) -> std::string
+    {
+        using Message = decltype(message);
+        known = true;
+
+        if constexpr (std::is_same_v<Message, Open> || std::is_same_v<Message, Close>)
+        {
+            target = std::is_same_v<Message, Open> ? OPEN : CLOSED;
+            if (cover == target)
+                return encode<StateReport>(static_cast<int>(cover));
+            cover = MOVING;
+            motionStart = Clock::now();
+            motionDone = motionStart + std::chrono::milliseconds(options.motionMs);
+            stateChanged();
+            return encode<StateReport>(static_cast<int>(cover));
+        }
+        else if constexpr (std::is_same_v<Message, Halt>)
+        {
+            if (cover == MOVING)
+            {
+                haltedProgress = progress();
+                cover = HALTED;
+                stateChanged();
+            }
+            return encode<StateReport>(static_cast<int>(cover));
+        }
+        else if constexpr (std::is_same_v<Message, QueryState>)
+            return encode<StateReport>(static_cast<int>(cover));
+        else if constexpr (std::is_same_v<Message, SetBrightness>)
+        {
+            if (brightness != std::get<0>(values))
+                stateChanged();
+            brightness = std::get<0>(values);
+            return encode<BrightnessReport>(brightness);
+        }
+        else if (options.legacy)
+        {
+            // Extensions not present in the original firmware
+            known = false;
+            return std::string();
+        }
+        else if constexpr (std::is_same_v<Message, Identify>)
+            return encode<IdentityReply>(std::string_view("PROMETHEUS-FPC 2.0-sim"));
+        else if constexpr (std::is_same_v<Message, Ping>)
+            return std::string();
+        else if constexpr (std::is_same_v<Message, Echo>)
+            return encode<EchoReply>(std::get<0>(values));
+        else if constexpr (std::is_same_v<Message, SetEvents>)
+        {
+            pushEvents = std::get<0>(values) == 1;
+            return encode<EventsReply>(std::get<0>(values));
+        }
+        else if constexpr (std::is_same_v<Message, QueryStatus>)
+            return statusLine();
+        else if constexpr (std::is_same_v<Message, QueryBauds>)
+            return encode<BaudsReply>(std::string_view("9600 115200 230400 500000"));
+        else if constexpr (std::is_same_v<Message, SetBaud>)
+        {
+            int requested = std::get<0>(values);
+            if (requested != 9600 && requested != 115200 && requested != 230400 && requested != 500000)
+            {
+                known = false;
+                return std::string();
+            }
+            // Acknowledge at the old rate, switch once the reply has been sent
+            pendingBaud = requested;
+            return encode<BaudReply>(requested);
+        }
+        else if constexpr (std::is_same_v<Message, SetFraming>)
+        {
+            pendingFraming = std::get<0>(values);
+            return encode<FramingReply>(std::get<0>(values));
+        }
+        else
+            return std::string();
+    });
+
+    return known ? response : encode<Error>(std::string_view("UNKNOWN"));
+}
+
+void PanelSimulator::handleLine(std::string_view line)
+{
+    if (options.verbose)
+        fprintf(stderr, "sim: <- %.*s\n", static_cast<int>(line.size()), line.data());
+
+    // Any valid command at a new rate or framing confirms it
+    baudRevert = Clock::time_point();
+    framingRevert = Clock::time_point();
+
+    std::string tag;
+    if (!options.legacy && startsWith(line, "#"))
+    {
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos)
+            return;
+        tag = std::string(line.substr(0, space));
+        line = line.substr(space + 1);
+    }
+
+    bool known;
+    std::string response = execute(line, known);
+    if (!response.empty() && (known || tag.empty()))
+        reply(response);
+    if (!tag.empty())
+        reply(tag + (known ? " OK" : " ERR UNKNOWN"));
+    announceChanges();
+
+    // The reply went out in the old framing; everything after uses the new one
+    if (pendingFraming >= 0)
+    {
+        setFraming(pendingFraming == 1);
+        pendingFraming = -1;
+    }
+}
+
+// A corrupted frame is never executed: the driver retries it when the
+// acknowledgement does not come
+void PanelSimulator::handleFrame(std::string_view frame)
+{
+    if (frame.empty())
+        return;
+
+    char line[128];
+    std::string_view command;
+    if (!protocol::binary::decodeFrame<protocol::binary::CommandFrames>(frame, line, sizeof(line), command))
+    {
+        badFrames++;
+        if (options.verbose)
+            fprintf(stderr, "sim: bad frame (%zu bytes), %u dropped so far\n", frame.size(), badFrames);
+        return;
+    }
+    handleLine(command);
+}
+
+// Binary mode must be confirmed by a valid frame within a second or it is
+// abandoned, so a driver that missed the switch is not locked out
+void PanelSimulator::setFraming(bool binary)
+{
+    if (binary != binaryFrames && options.verbose)
+        fprintf(stderr, "sim: %s frames\n", binary ? "binary" : "text");
+    binaryFrames = binary;
+    framer.setDelimiter(binary ? static_cast<char>(protocol::binary::END) : '\n');
+    framingRevert = binary ? Clock::now() + std::chrono::seconds(1) : Clock::time_point();
+}
+
+void PanelSimulator::finishMotion()
+{
+    cover = target;
+    stateChanged();
+    announceChanges();
+}
+
+void PanelSimulator::stateChanged()
+{
+    statusSequence = (statusSequence + 1) & 0xffff;
+    changePending = true;
+}
+
+// Without EVENTS ON the driver only learns about changes by polling
+void PanelSimulator::announceChanges()
+{
+    if (!changePending)
+        return;
+    changePending = false;
+    if (pushEvents)
+        reply(statusLine());
+}
+
+// Percent of the current or last movement completed
+int PanelSimulator::progress() const
+{
+    if (cover == HALTED)
+        return haltedProgress;
+    if (cover != MOVING)
+        return 100;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - motionStart).count();
+    return static_cast<int>(std::clamp<long long>(elapsed * 100 / std::max(options.motionMs, 1), 0, 99));
+}
+
+std::string PanelSimulator::statusLine() const
+{
+    return encode<protocol::StatusReport>(static_cast<int>(cover), brightness, brightness > 0 ? 1 : 0, progress(),
+                                          static_cast<int>(statusSequence));
+}
+
+void PanelSimulator::flushOutput()
+{
+    auto now = Clock::now();
+    char chunk[256];
+    size_t n = 0;
+    while (!outbound.empty() && outbound.front().due <= now && n < sizeof(chunk))
+    {
+        chunk[n++] = outbound.front().byte;
+        outbound.pop_front();
+    }
+    if (n > 0 && write(master, chunk, n) < 0 && errno != EAGAIN && errno != EIO)
+        perror("sim: write");
+
+    // The BAUD reply has left at the old rate; switch and wait for confirmation
+    if (pendingBaud != 0 && outbound.empty())
+    {
+        baud = pendingBaud;
+        pendingBaud = 0;
+        baudRevert = now + std::chrono::seconds(1);
+    }
+}
+
+Clock::time_point PanelSimulator::nextDeadline() const
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(1);
+    if (!inbound.empty())
+        deadline = std::min(deadline, inbound.front().due);
+    if (!outbound.empty())
+        deadline = std::min(deadline, outbound.front().due);
+    if (cover == MOVING)
+        deadline = std::min(deadline, motionDone);
+    if (booting)
+        deadline = std::min(deadline, bootDone);
+    if (baudRevert != Clock::time_point())
+        deadline = std::min(deadline, baudRevert);
+    if (framingRevert != Clock::time_point())
+        deadline = std::min(deadline, framingRevert);
+    return deadline;
+}
+
+void PanelSimulator::run()
+{
+    while (running)
+    {
+        // The master reports POLLHUP while nobody has the slave open
+        if (!slaveOpen)
+        {
+            if (listener >= 0)
+            {
+                struct pollfd lfd = { listener, POLLIN, 0 };
+                if (poll(&lfd, 1, 100) <= 0)
+                    continue;
+                master = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (master < 0)
+                    continue;
+                int on = 1;
+                setsockopt(master, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            else
+            {
+                struct pollfd pfd = { master, POLLIN, 0 };
+                if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP))
+                {
+                    usleep(10000);
+                    continue;
+                }
+            }
+            slaveOpen = true;
+            onSlaveOpened();
+        }
+        struct pollfd pfd = { master, POLLIN, 0 };
+
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextDeadline() - Clock::now()).count();
+        int rc = poll(&pfd, 1, static_cast<int>(std::max<long long>(wait, 0)));
+        if (rc < 0 && errno != EINTR)
+        {
+            perror("sim: poll");
+            return;
+        }
+
+        char chunk[256];
+        ssize_t n = -1;
+        if (rc > 0 && (pfd.revents & POLLIN))
+            n = read(master, chunk, sizeof(chunk));
+
+        // A socket peer that closes reads as EOF rather than POLLHUP
+        if (rc > 0 && ((pfd.revents & POLLHUP) || (listener >= 0 && n == 0)))
+        {
+            if (options.verbose)
+                fprintf(stderr, "sim: port closed\n");
+            slaveOpen = false;
+            if (listener >= 0)
+            {
+                close(master);
+                master = -1;
+            }
+            continue;
+        }
+
+        // A board in its bootloader ignores the sketch protocol entirely
+        if (n > 0 && !booting)
+            receive(chunk, n);
+
+        auto now = Clock::now();
+        if (booting && now >= bootDone)
+        {
+            booting = false;
+            if (!options.legacy)
+                reply("READY");
+        }
+
+        while (!inbound.empty() && inbound.front().due <= now)
+        {
+            size_t space;
+            char *dest = framer.writeSpace(space);
+            size_t n = 0;
+            while (n < space && !inbound.empty() && inbound.front().due <= now)
+            {
+                dest[n++] = inbound.front().byte;
+                inbound.pop_front();
+            }
+            framer.commit(n);
+
+            // FRAMING can switch the framer between two lines of one chunk
+            std::string_view line;
+            while (framer.nextLine(line))
+            {
+                if (binaryFrames)
+                    handleFrame(line);
+                else
+                    handleLine(line);
+            }
+        }
+
+        if (cover == MOVING && now >= motionDone)
+            finishMotion();
+
+        if (baudRevert != Clock::time_point() && now >= baudRevert)
+        {
+            if (options.verbose)
+                fprintf(stderr, "sim: no command at %d baud, reverting to 9600\n", baud);
+            baud = 9600;
+            baudRevert = Clock::time_point();
+        }
+
+        if (framingRevert != Clock::time_point() && now >= framingRevert)
+        {
+            if (options.verbose)
+                fprintf(stderr, "sim: no valid frame after FRAMING BINARY, back to text\n");
+            setFraming(false);
+        }
+
+        flushOutput();
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --link PATH          create a symlink to the pty at PATH\n"
+            "  --listen ADDR        serve tcp:PORT or unix:PATH instead of a pty\n"
+            "  --motion-ms N        cover travel time (default 3000)\n"
+            "  --boot-ms N          time to READY after a reset (default 2000)\n"
+            "  --byte-delay-us N    extra delay per byte on the wire (default 0)\n"
+            "  --jitter-us N        random extra delay per byte, 0..N (default 0)\n"
+            "  --no-baud-model      do not add 10 bits per byte at the link rate\n"
+            "  --drop-rate P        probability a byte is lost (default 0)\n"
+            "  --corrupt-rate P     probability a byte has a bit flipped (default 0)\n"
+            "  --reset-on-open      reboot like an Arduino whenever the port is opened\n"
+            "  --legacy             only OPEN/CLOSE/HALT/STATE/BRIGHTNESS, no extensions\n"
+            "  --verbose            log traffic to stderr\n",
+            argv0);
+}
+
+// "tcp:PORT" on all interfaces or "unix:PATH"
+static int listenOn(const std::string &address)
+{
+    int fd;
+    if (address.compare(0, 4, "tcp:") == 0)
+    {
+        fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1, off = 0;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        struct sockaddr_in6 sa = {};
+        sa.sin6_family = AF_INET6;
+        sa.sin6_addr = in6addr_any;
+        sa.sin6_port = htons(static_cast<uint16_t>(atoi(address.c_str() + 4)));
+        if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) != 0)
+        {
+            perror("sim: bind");
+            return -1;
+        }
+    }
+    else if (address.compare(0, 5, "unix:") == 0)
+    {
+        struct sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof(sa.sun_path))
+        {
+            fprintf(stderr, "sim: invalid socket path\n");
+            return -1;
+        }
+        memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) != 0)
+        {
+            perror("sim: bind");
+            return -1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "sim: --listen takes tcp:PORT or unix:PATH\n");
+        return -1;
+    }
+
+    // One client at a time, like a serial port
+    if (listen(fd, 1) != 0)
+    {
+        perror("sim: listen");
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option longOptions[] =
+    {
+        { "link", required_argument, nullptr, 'l' },
+        { "listen", required_argument, nullptr, 'S' },
+        { "motion-ms", required_argument, nullptr, 'm' },
+        { "boot-ms", required_argument, nullptr, 'b' },
+        { "byte-delay-us", required_argument, nullptr, 'd' },
+        { "jitter-us", required_argument, nullptr, 'j' },
+        { "no-baud-model", no_argument, nullptr, 'n' },
+        { "drop-rate", required_argument, nullptr, 'D' },
+        { "corrupt-rate", required_argument, nullptr, 'C' },
+        { "reset-on-open", no_argument, nullptr, 'r' },
+        { "legacy", no_argument, nullptr, 'L' },
+        { "verbose", no_argument, nullptr, 'v' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    SimulatorOptions options;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:S:m:b:d:j:nD:C:rLvh", longOptions, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+                options.link = optarg;
+                break;
+            case 'S':
+                options.listen = optarg;
+                break;
+            case 'm':
+                options.motionMs = atoi(optarg);
+                break;
+            case 'b':
+                options.bootMs = atoi(optarg);
+                break;
+            case 'd':
+                options.byteDelayUs = atoi(optarg);
+                break;
+            case 'j':
+                options.jitterUs = atoi(optarg);
+                break;
+            case 'n':
+                options.modelBaud = false;
+                break;
+            case 'D':
+                options.dropRate = atof(optarg);
+                break;
+            case 'C':
+                options.corruptRate = atof(optarg);
+                break;
+            case 'r':
+                options.resetOnOpen = true;
+                break;
+            case 'L':
+                options.legacy = true;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!options.listen.empty())
+    {
+        int listener = listenOn(options.listen);
+        if (listener < 0)
+            return 1;
+        printf("%s\n", options.listen.c_str());
+        fflush(stdout);
+
+        PanelSimulator simulator(-1, listener, options);
+        simulator.run();
+
+        close(listener);
+        if (options.listen.compare(0, 5, "unix:") == 0)
+            unlink(options.listen.c_str() + 5);
+        return 0;
+    }
+
+    int master, slave;
+    char slaveName[256];
+    struct termios raw;
+    memset(&raw, 0, sizeof(raw));
+    cfmakeraw(&raw);
+    if (openpty(&master, &slave, slaveName, &raw, nullptr) != 0)
+    {
+        perror("openpty");
+        return 1;
+    }
+    // Closing our end lets the master see when the driver opens and closes the port
+    close(slave);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    if (!options.link.empty())
+    {
+        unlink(options.link.c_str());
+        if (symlink(slaveName, options.link.c_str()) != 0)
+        {
+            perror("symlink");
+            return 1;
+        }
+    }
+
+    printf("%s\n", options.link.empty() ? slaveName : options.link.c_str());
+    fflush(stdout);
+
+    PanelSimulator simulator(master, -1, options);
+    simulator.run();
+
+    if (!options.link.empty())
+        unlink(options.link.c_str());
+    close(master);
+    return 0;
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+// One byte stream to the panel. Every backend ends up as a single descriptor
+// that the driver's I/O thread polls, reads and writes, so line framing,
+// parsing and the command pipeline are the same for all of them. open() leaves
+// the descriptor blocking; the I/O thread switches it to O_NONBLOCK itself.
+class PanelTransport
+{
+public:
+    enum Kind
+    {
+        SERIAL,  // USB serial adapter, found by discovery
+        PTY,     // pseudo-terminal, e.g. the firmware simulator
+        TCP,     // ser2net or any raw TCP bridge
+        UNIX     // Unix-domain stream socket
+    };
+
+    virtual ~PanelTransport()
+    {
+        close();
+    }
+
+    virtual Kind kind() const = 0;
+
+    // Opens or reopens the link; false with a reason on failure
+    virtual bool open(std::string &error) = 0;
+
+    // Panel UART rate. Only a tty can change it; a TCP bridge keeps whatever
+    // rate its own configuration sets.
+    virtual bool setSpeed(int baud, std::string &error)
+    {
+        (void)baud;
+        error = "link has no line speed";
+        return false;
+    }
+
+    bool canSetSpeed() const
+    {
+        return kind() == SERIAL || kind() == PTY;
+    }
+
+    void close()
+    {
+        if (linkFD >= 0)
+            ::close(linkFD);
+        linkFD = -1;
+    }
+
+    int fd() const
+    {
+        return linkFD;
+    }
+
+    const std::string &address() const
+    {
+        return target;
+    }
+
+protected:
+    explicit PanelTransport(std::string address) : target(std::move(address)) {}
+
+    static void setBlocking(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    int linkFD = -1;
+    std::string target;
+};
+
+// Local tty: raw 8N1 at 9600 until the driver negotiates a faster rate
+class SerialTransport : public PanelTransport
+{
+public:
+    explicit SerialTransport(std::string path, Kind kind = SERIAL) : PanelTransport(std::move(path)), type(kind) {}
+
+    Kind kind() const override
+    {
+        return type;
+    }
+
+    bool open(std::string &error) override
+    {
+        close();
+        int fd = ::open(target.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            error = strerror(errno);
+            return false;
+        }
+        if (!configure(fd, error))
+        {
+            ::close(fd);
+            return false;
+        }
+        setBlocking(fd);
+        linkFD = fd;
+        return true;
+    }
+
+    // Takes over a descriptor that discovery already opened, configured and verified
+    void adopt(int fd, const std::string &path)
+    {
+        close();
+        setBlocking(fd);
+        linkFD = fd;
+        target = path;
+    }
+
+    bool setSpeed(int baud, std::string &error) override
+    {
+        speed_t speed;
+        switch (baud)
+        {
+            case 9600:
+                speed = B9600;
+                break;
+            case 115200:
+                speed = B115200;
+                break;
+            case 230400:
+                speed = B230400;
+                break;
+            case 500000:
+                speed = B500000;
+                break;
+            default:
+                error = "unsupported rate";
+                return false;
+        }
+
+        struct termios options;
+        if (tcgetattr(linkFD, &options) != 0)
+        {
+            error = strerror(errno);
+            return false;
+        }
+
+        // Let the last command leave at the old rate before switching
+        tcdrain(linkFD);
+        cfsetispeed(&options, speed);
+        cfsetospeed(&options, speed);
+        if (tcsetattr(linkFD, TCSANOW, &options) != 0)
+        {
+            error = strerror(errno);
+            return false;
+        }
+
+        tcflush(linkFD, TCIFLUSH);
+        return true;
+    }
+
+    static bool configure(int fd, std::string &error)
+    {
+        struct termios options;
+        if (tcgetattr(fd, &options) != 0)
+        {
+            error = std::string("tcgetattr failed: ") + strerror(errno);
+            return false;
+        }
+
+        // Raw 8N1: no line discipline, echo, signals or flow control
+        cfmakeraw(&options);
+        options.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+        options.c_cflag |= (CS8 | CLOCAL | CREAD);
+        options.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+        // read() returns whatever is buffered and never waits; poll() does the waiting
+        options.c_cc[VMIN] = 0;
+        options.c_cc[VTIME] = 0;
+
+        cfsetispeed(&options, B9600);
+        cfsetospeed(&options, B9600);
+
+        if (tcsetattr(fd, TCSANOW, &options) != 0)
+        {
+            error = std::string("tcsetattr failed: ") + strerror(errno);
+            return false;
+        }
+
+        tcflush(fd, TCIOFLUSH);
+        return true;
+    }
+
+private:
+    Kind type;
+};
+
+// Stream sockets. The connect is non-blocking with a deadline so an
+// unreachable pier cannot hang Connect() for the kernel's SYN timeout.
+class SocketTransport : public PanelTransport
+{
+protected:
+    using PanelTransport::PanelTransport;
+
+    static constexpr int connectTimeoutMs = 3000;
+
+    bool connectSocket(int fd, const struct sockaddr *address, socklen_t length, std::string &error)
+    {
+        if (connect(fd, address, length) != 0)
+        {
+            if (errno != EINPROGRESS)
+            {
+                error = strerror(errno);
+                return false;
+            }
+
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int rc;
+            while ((rc = poll(&pfd, 1, connectTimeoutMs)) < 0 && errno == EINTR)
+                ;
+            if (rc == 0)
+            {
+                error = "connection timed out";
+                return false;
+            }
+
+            int result = 0;
+            socklen_t size = sizeof(result);
+            if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &size) != 0 || result != 0)
+            {
+                error = strerror(rc < 0 ? errno : result);
+                return false;
+            }
+        }
+
+        setBlocking(fd);
+        linkFD = fd;
+        return true;
+    }
+};
+
+// "host:port", e.g. a ser2net raw port. Nagle is off so each command line
+// leaves in its own segment, and keepalive notices a pier that lost power.
+class TcpTransport : public SocketTransport
+{
+public:
+    explicit TcpTransport(std::string address) : SocketTransport(std::move(address)) {}
+
+    Kind kind() const override
+    {
+        return TCP;
+    }
+
+    bool open(std::string &error) override
+    {
+        close();
+        size_t colon = target.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == target.size())
+        {
+            error = "address must be host:port";
+            return false;
+        }
+        std::string host = target.substr(0, colon);
+        std::string port = target.substr(colon + 1);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *addresses = nullptr;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+        if (rc != 0)
+        {
+            error = gai_strerror(rc);
+            return false;
+        }
+
+        error = "no address";
+        for (struct addrinfo *ai = addresses; ai != nullptr; ai = ai->ai_next)
+        {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0)
+            {
+                error = strerror(errno);
+                continue;
+            }
+
+            int on = 1, idle = 10, interval = 5, probes = 3;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+
+            if (connectSocket(fd, ai->ai_addr, ai->ai_addrlen, error))
+                break;
+            ::close(fd);
+        }
+        freeaddrinfo(addresses);
+        return linkFD >= 0;
+    }
+};
+
+// Filesystem path of a listening Unix-domain stream socket
+class UnixTransport : public SocketTransport
+{
+public:
+    explicit UnixTransport(std::string path) : SocketTransport(std::move(path)) {}
+
+    Kind kind() const override
+    {
+        return UNIX;
+    }
+
+    bool open(std::string &error) override
+    {
+        close();
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (target.empty() || target.size() >= sizeof(address.sun_path))
+        {
+            error = "invalid socket path";
+            return false;
+        }
+        memcpy(address.sun_path, target.c_str(), target.size() + 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            error = strerror(errno);
+            return false;
+        }
+        if (!connectSocket(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address), error))
+        {
+            ::close(fd);
+            return false;
+        }
+        return true;
+    }
+};
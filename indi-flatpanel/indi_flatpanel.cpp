@@ -1,8 +1,41 @@
+// INDI driver for the PrometheusAstro flat panel and dust cover.
+//
+// Needs C++20 (the sequences in flatpanel_sequence.h are coroutines) and the
+// libindi development headers; the simulator and bench/ only need C++17.
+//
+//   g++ -std=c++20 -O2 -I/usr/include/libindi -o indi_flatpanel indi_flatpanel.cpp -lindidriver -lpthread
+
 #include "defaultdevice.h"
+#include "eventloop.h"
+#include "flatpanel_protocol.h"
+#include "flatpanel_sequence.h"
+#include "flatpanel_transport.h"
+#include "spsc_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 #include <termios.h>
 #include <glob.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 class FlatPanelCover : public INDI::DefaultDevice
@@ -16,18 +49,317 @@ public:
 protected:
     virtual bool initProperties() override;
     virtual bool updateProperties() override;
+    virtual void ISGetProperties(const char *dev) override;
+    virtual bool saveConfigItems(FILE *fp) override;
     virtual bool Connect() override;
     virtual bool Disconnect() override;
-    virtual void TimerHit() override;
     virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n) override;
     virtual bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n) override;
+    virtual bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n) override;
 
 private:
     bool findArduinoPort();
-    bool sendCommand(const char *cmd);
-    bool readResponse(char *response, int maxLength);
-    int serialFD = -1;
-    std::string serialPort;
+    bool openCachedPort();
+    void rememberUSBIdentity();
+    static bool readUSBIdentity(const std::string &port, std::string identity[3]);
+    static std::string findPortByUSBIdentity(const std::string identity[3]);
+    static std::vector<std::string> candidatePorts();
+    static int probePort(const std::string &port, bool suppressReset, const std::atomic<bool> &cancelled);
+    static void applyResetPolicy(int fd, bool suppressReset);
+    void adoptSerial(int fd, const std::string &port);
+    bool openTransport(std::string &error);
+    void closeLink();
+    bool setPortSpeed(int baud);
+    void tuneLowLatency();
+    bool nextResponse(std::string_view &response);
+    bool readResponse(std::string_view &response, std::chrono::steady_clock::time_point deadline);
+    bool expectLine(std::string_view prefix, std::string_view &response, std::chrono::steady_clock::time_point deadline);
+    std::chrono::steady_clock::time_point replyDeadline() const;
+    bool pauseHandshake(std::chrono::milliseconds duration);
+    bool verifyEcho();
+    int negotiateBaudRate();
+    bool measureRoundTrip(double &milliseconds);
+    bool negotiateBinaryFrames();
+    void resetFraming();
+    bool negotiateLink();
+    void applyNegotiatedLink();
+    bool startLink();
+
+    // Background connect: discovery, open and handshake run on connectThread so
+    // the event loop keeps serving clients. Progress and the result come back
+    // through connectEventFD; finishConnect() reports them with setConnected().
+    // Recovery after the link drops runs the same way.
+    void captureLinkSettings();
+    bool startConnectThread();
+    void connectWorker();
+    bool reopenLink(std::string &error);
+    void reportConnectProgress(const std::string &text);
+    static void connectEventCallback(int fd, void *userpointer);
+    void finishConnect();
+    void finishReconnect();
+    void cancelConnect();
+    void setConnectionStatus(const std::string &text, IPState state);
+    bool linkReady() const;
+
+    // Hotplug recovery: watch /dev after the link drops, reopen and resend the last requests
+    void handleLinkLost();
+    bool startHotplugWatch();
+    void stopHotplugWatch();
+    static void hotplugCallback(int fd, void *userpointer);
+    void tryReconnect();
+    void scheduleReconnect();
+    static void reconnectTimerCallback(void *userpointer);
+    void resyncPanel();
+    void checkResync();
+    bool sendCommand(std::string_view cmd, bool priority = false);
+    bool sendHandshake(std::string_view cmd);
+
+    // Sequence-tagged command pipeline: "#<seq> <cmd>" is answered by "#<seq> OK"
+    // or "#<seq> ERR ...". Up to CommandWindow commands are in flight at once.
+    struct QueuedCommand
+    {
+        enum Target
+        {
+            COVER,
+            BRIGHTNESS,
+            QUERY
+        } target;
+        std::string text;
+        // HALT and CLOSE: sent at once outside the window, ahead of queued
+        // traffic, and timed against the safety budget
+        bool priority;
+        unsigned sequence;
+        // Order of first transmission; sequence numbers wrap, this does not
+        uint64_t issued;
+        int attempts;
+        std::chrono::steady_clock::time_point queued;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    bool detectSequenceTags();
+    bool queueCommand(QueuedCommand::Target target, std::string_view cmd, bool priority = false);
+    void sendTagged(QueuedCommand &command);
+    std::chrono::milliseconds commandTimeout(const QueuedCommand &command) const;
+    void pumpCommands();
+    void completeCommand(unsigned sequence, bool success);
+    void failCommand(const QueuedCommand &command, const std::string &reason);
+    void cancelCommands();
+    void armCommandTimer();
+    static void commandTimerCallback(void *userpointer);
+    void checkCommandTimeouts();
+    bool commandsInFlight(QueuedCommand::Target target) const;
+    bool superseded(const QueuedCommand &command) const;
+
+    // Motion budget: OPEN and CLOSE must be reported complete within
+    // TimeoutBudgets MOTION seconds, acknowledged or not
+    void armMotionTimer();
+    void stopMotionTimer();
+    static void motionTimerCallback(void *userpointer);
+
+    // Client-level requests, shared by the property handlers and sequences
+    void commandCover(int position);
+    void commandBrightness(int brightness);
+
+    // Multi-step operations (Flat Calibration), coroutines that co_await one
+    // step after another. Advanced at the end of every event loop pass and by
+    // a timer at the earliest step deadline.
+    void runSequence(PanelSequence sequence);
+    void cancelSequence(const std::string &name, const std::string &reason);
+    void advanceSequences();
+    void cancelSequences(const std::string &reason);
+    static void sequenceTimerCallback(void *userpointer);
+    PanelSequence::Step coverStep(int position);
+    PanelSequence::Step brightnessStep(int brightness);
+    PanelSequence::Body flatCalibration(bool lightOn);
+    void startFlatCalibration(bool lightOn);
+
+    // Latest-wins brightness: one BRIGHTNESS on the wire, newer requests replace the pending one
+    void requestBrightness(int brightness);
+    void pumpBrightness();
+    static void brightnessTimerCallback(void *userpointer);
+
+    // Serial I/O thread: owns linkFD once started. Commands reach it through
+    // txQueue and parsed events come back through rxQueue, both lock-free SPSC;
+    // ioWakeFD wakes the thread, ioEventFD wakes the main loop.
+    struct OutboundLine
+    {
+        uint16_t length;
+        char text[94];
+    };
+    bool startIOThread();
+    void stopIOThread();
+    void ioThreadLoop();
+    bool drainLines();
+    void wakeIOThread();
+    void wakeMainLoop();
+    bool frameCommand(std::string_view cmd, OutboundLine &line) const;
+    bool writeLine(const OutboundLine &line);
+    static void ioEventCallback(int fd, void *userpointer);
+    void processEvents();
+    void applyCoverEvent(PanelEvent::Type type);
+    void applyStatus(const PanelEvent &event);
+    bool queryStatus();
+
+    // Status polling: fast while the cover moves or a command is outstanding,
+    // backing off exponentially once stable, and off entirely when the firmware
+    // pushes changes itself (EVENTS ON)
+    bool enablePushEvents();
+    bool pollingActive() const;
+    int pollReplyMs() const;
+    void schedulePoll(bool reset);
+    void stopPolling();
+    static void pollTimerCallback(void *userpointer);
+
+    // Change-only publishing: the runtime vectors are compared with what clients
+    // last saw and only those that differ are sent, once per event loop pass.
+    enum PublishedVector
+    {
+        COVER_VECTOR = 1 << 0,
+        BRIGHTNESS_VECTOR = 1 << 1,
+        STATUS_VECTOR = 1 << 2,
+        UPDATES_VECTOR = 1 << 3
+    };
+    void markDirty(unsigned vectors);
+    void recordPublished(unsigned vectors);
+    void flushProperties();
+
+    // Connection settings as they were when Connect started, so clients can edit
+    // the properties while discovery runs on the connect thread, and what the
+    // handshake found out, applied by applyNegotiatedLink() on the main thread
+    struct
+    {
+        int mode;
+        std::string address;
+        std::string portOverride;
+        std::string identity[3];
+        bool suppressReset;
+        bool binaryFrames;
+        std::chrono::milliseconds replyTimeout;
+
+        int baud;
+        bool sequenceTags;
+        bool statusQuery;
+        bool pushEvents;
+    } linkSettings;
+
+    std::thread connectThread;
+    std::atomic<bool> connectCancelled { false };
+    std::atomic<bool> connectFinished { false };
+    bool connectResult = false;
+    std::string connectError;
+    std::mutex connectMutex;
+    // Latest progress line from the connect thread, guarded by connectMutex
+    std::string connectProgress;
+    int connectEventFD = -1;
+    int connectCallbackID = -1;
+
+    // Descriptor and address of the open transport; the transport owns the fd
+    std::unique_ptr<PanelTransport> transport;
+    int linkFD = -1;
+    std::string linkAddress;
+    LineFramer<1024, 256> rxFramer;
+    // Binary framing in use (protocol::binary); cleared by the I/O thread when
+    // the firmware restarts in text mode. Frames are unpacked into frameText.
+    std::atomic<bool> binaryFrames { false };
+    std::atomic<unsigned> badFrames { 0 };
+    char frameText[128];
+
+    std::thread ioThread;
+    std::atomic<bool> ioRunning { false };
+    int ioWakeFD = -1;
+    int ioEventFD = -1;
+    int ioCallbackID = -1;
+    SpscQueue<OutboundLine, 64> txQueue;
+    SpscQueue<OutboundLine, 8> txPriorityQueue;
+    SpscQueue<PanelEvent, 256> rxQueue;
+    // Bytes accepted by sendCommand() but not yet written to linkFD
+    std::atomic<size_t> txBytes { 0 };
+    // Set by the I/O thread when rxQueue is full and it stopped reading
+    std::atomic<bool> rxStalled { false };
+    std::atomic<bool> ioLinkLost { false };
+    PanelEvent stalledEvent;
+    std::atomic<unsigned> malformedLines { 0 };
+    // A restarted firmware is back at 9600 baud on text. Above 9600 or on
+    // binary frames it cannot be followed in place: its READY and replies
+    // arrive as noise, and a run of RestartNoise bytes that never parse (I/O
+    // thread count) is taken as a restart and the link is negotiated again.
+    static constexpr size_t RestartNoise = 128;
+    bool linkUpgraded = false;
+    size_t unparsedBytes = 0;
+
+    int hotplugFD = -1;
+    int hotplugCallbackID = -1;
+    int reconnectTimerID = -1;
+    // connectThread is reopening a lost link, not running Connect
+    bool recovering = false;
+    // A hotplug event came while an attempt was already running
+    bool reconnectAgain = false;
+
+    // The connection settings are read from the config once per driver run;
+    // loadingConfig marks the ISNew* calls that come from the config file
+    bool configLoaded = false;
+    bool loadingConfig = false;
+
+    // Last values requested by clients, replayed after a reconnect
+    int requestedCover = -1;
+    int requestedBrightness = -1;
+    bool resyncPending = false;
+    int reportedCover = -1;
+    int reportedBrightness = -1;
+    // OPEN or CLOSE issued: a position report that may predate it does not
+    // set reportedCover. With tags that is anything before the command's ack,
+    // without them anything already received when it was sent.
+    bool coverReportStale = false;
+    uint64_t eventsSeen = 0;
+    uint64_t coverReportsFrom = 0;
+
+    bool sequenceTags = false;
+    unsigned nextSequence = 1;
+    std::deque<QueuedCommand> commandQueue;
+    std::deque<QueuedCommand> commandsSent;
+    int commandTimerID = -1;
+    // Last command sent per QueuedCommand::Target, by issue order
+    uint64_t commandsIssued = 0;
+    uint64_t latestIssued[3] = {};
+
+    int pendingBrightness = -1;
+    int brightnessTimerID = -1;
+    int motionTimerID = -1;
+
+    std::deque<PanelSequence> sequences;
+    int sequenceTimerID = -1;
+    // A status query went unanswered; the next report clears the alert
+    bool queryTimedOut = false;
+
+    // STATUS support, last sequence seen (-1 until the first STATUS after a
+    // (re)connect or firmware restart) and sequence gaps seen with EVENTS ON
+    bool statusQuery = false;
+    int statusSequence = -1;
+    unsigned missedUpdates = 0;
+
+    bool pushEvents = false;
+    bool coverMoving = false;
+    int pollTimerID = -1;
+    int pollInterval = 0;
+    // One poll on the wire at a time: set when sent, cleared by the reply or
+    // when pollDeadline passes without one
+    bool pollOutstanding = false;
+    std::chrono::steady_clock::time_point pollDeadline;
+
+    // Copy of the vectors as last sent, and vectors to send regardless (client
+    // replies, messages)
+    struct
+    {
+        ISState cover[2];
+        IPState coverState;
+        double brightness;
+        IPState brightnessState;
+        std::string status;
+        IPState statusState;
+        double updates[2];
+    } published;
+    unsigned dirtyVectors = 0;
+    std::string coverMessage;
+    std::string brightnessMessage;
 
     ISwitchVectorProperty CoverControl;
     ISwitch CoverOptions[2];
@@ -37,6 +369,57 @@ private:
 
     ITextVectorProperty StatusFeedback;
     IText StatusMessages[1];
+
+    INumberVectorProperty LinkSpeed;
+    INumber LinkSpeedValue[1];
+
+    // Vendor, product and serial of the last verified panel, kept in the config
+    ITextVectorProperty USBIdentity;
+    IText USBIdentityValues[3];
+
+    ISwitchVectorProperty AutoReset;
+    ISwitch AutoResetOptions[2];
+
+    // Binary frames when the firmware offers them, or text only (e.g. to watch the traffic)
+    ISwitchVectorProperty Framing;
+    ISwitch FramingOptions[2];
+
+    INumberVectorProperty CommandWindow;
+    INumber CommandWindowValues[4];
+
+    // Per command type: brightness ack, cover travel, handshake reply
+    INumberVectorProperty TimeoutBudgets;
+    INumber TimeoutBudgetValues[3];
+
+    ISwitchVectorProperty AbortControl;
+    ISwitch AbortOption[1];
+
+    // START closes the cover and lights the panel for flats, STOP turns it off and opens
+    ISwitchVectorProperty FlatCalibration;
+    ISwitch FlatCalibrationOptions[2];
+
+    INumberVectorProperty FlatBrightness;
+    INumber FlatBrightnessValue[1];
+
+    INumberVectorProperty BrightnessUpdates;
+    INumber BrightnessUpdatesValues[2];
+
+    INumberVectorProperty StatusPolling;
+    INumber StatusPollingValues[3];
+
+    ITextVectorProperty ConnectionStatus;
+    IText ConnectionStatusValue[1];
+
+    ISwitchVectorProperty TransportMode;
+    ISwitch TransportModeOptions[4];
+
+    // host:port for TCP, a path for pty and Unix socket links
+    ITextVectorProperty TransportAddress;
+    IText TransportAddressValue[1];
+
+    // Fixed device path for the serial transport; empty means automatic discovery
+    ITextVectorProperty PortOverride;
+    IText PortOverrideValue[1];
 };
 
 // Constructor
@@ -53,8 +436,16 @@ const char *FlatPanelCover::getDefaultName()
 
 FlatPanelCover::~FlatPanelCover()
 {
-    if (serialFD >= 0)
-        close(serialFD);
+    if (connectThread.joinable())
+    {
+        connectCancelled = true;
+        connectThread.join();
+        IERmCallback(connectCallbackID);
+        close(connectEventFD);
+    }
+    stopHotplugWatch();
+    stopIOThread();
+    closeLink();
 }
 
 bool FlatPanelCover::initProperties()
@@ -65,164 +456,2824 @@ bool FlatPanelCover::initProperties()
     IUFillSwitch(&CoverOptions[1], "CLOSE", "Close Cover", ISS_OFF);
     IUFillSwitchVector(&CoverControl, CoverOptions, 2, getDeviceName(), "Cover Control", "", MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
 
+    IUFillSwitch(&AbortOption[0], "ABORT", "Abort", ISS_OFF);
+    IUFillSwitchVector(&AbortControl, AbortOption, 1, getDeviceName(), "Cover Abort", "", MAIN_CONTROL_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    IUFillSwitch(&FlatCalibrationOptions[0], "START", "Close and Light", ISS_OFF);
+    IUFillSwitch(&FlatCalibrationOptions[1], "STOP", "Dark and Open", ISS_OFF);
+    IUFillSwitchVector(&FlatCalibration, FlatCalibrationOptions, 2, getDeviceName(), "Flat Calibration", "", MAIN_CONTROL_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+    IUFillNumber(&FlatBrightnessValue[0], "LEVEL", "Flat Brightness", "%0.f", 0, 4095, 1, 2048);
+    IUFillNumberVector(&FlatBrightness, FlatBrightnessValue, 1, getDeviceName(), "Flat Brightness", "", MAIN_CONTROL_TAB, IP_RW, 0, IPS_IDLE);
+
     IUFillNumber(&BrightnessValue[0], "BRIGHTNESS", "Brightness Level", "%0.f", 0, 4095, 1, 0);
     IUFillNumberVector(&BrightnessControl, BrightnessValue, 1, getDeviceName(), "Brightness Control", "", MAIN_CONTROL_TAB, IP_RW, 0, IPS_IDLE);
 
     IUFillText(&StatusMessages[0], "STATUS", "Device Status", "Disconnected");
     IUFillTextVector(&StatusFeedback, StatusMessages, 1, getDeviceName(), "Device Status", "", MAIN_CONTROL_TAB, IP_RO, 0, IPS_IDLE);
 
+    IUFillNumber(&LinkSpeedValue[0], "BAUD_RATE", "Baud Rate", "%0.f", 0, 500000, 0, 9600);
+    IUFillNumberVector(&LinkSpeed, LinkSpeedValue, 1, getDeviceName(), "Link Speed", "", CONNECTION_TAB, IP_RO, 0, IPS_IDLE);
+
+    IUFillText(&ConnectionStatusValue[0], "MESSAGE", "Status", "Disconnected");
+    IUFillTextVector(&ConnectionStatus, ConnectionStatusValue, 1, getDeviceName(), "CONNECTION_STATUS", "Connection Status", CONNECTION_TAB, IP_RO, 0, IPS_IDLE);
+
+    // Indexed by PanelTransport::Kind
+    IUFillSwitch(&TransportModeOptions[0], "SERIAL", "USB Serial", ISS_ON);
+    IUFillSwitch(&TransportModeOptions[1], "PTY", "Pseudo-terminal", ISS_OFF);
+    IUFillSwitch(&TransportModeOptions[2], "TCP", "TCP (ser2net)", ISS_OFF);
+    IUFillSwitch(&TransportModeOptions[3], "UNIX", "Unix Socket", ISS_OFF);
+    IUFillSwitchVector(&TransportMode, TransportModeOptions, 4, getDeviceName(), "Transport", "", CONNECTION_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    IUFillText(&TransportAddressValue[0], "ADDRESS", "Address", "");
+    IUFillTextVector(&TransportAddress, TransportAddressValue, 1, getDeviceName(), "Transport Address", "", CONNECTION_TAB, IP_RW, 0, IPS_IDLE);
+
+    IUFillText(&PortOverrideValue[0], "PORT", "Port", "");
+    IUFillTextVector(&PortOverride, PortOverrideValue, 1, getDeviceName(), "Serial Port", "", CONNECTION_TAB, IP_RW, 0, IPS_IDLE);
+
+    IUFillText(&USBIdentityValues[0], "VENDOR", "Vendor ID", "");
+    IUFillText(&USBIdentityValues[1], "PRODUCT", "Product ID", "");
+    IUFillText(&USBIdentityValues[2], "SERIAL", "Serial Number", "");
+    IUFillTextVector(&USBIdentity, USBIdentityValues, 3, getDeviceName(), "USB Identity", "", CONNECTION_TAB, IP_RO, 0, IPS_IDLE);
+
+    IUFillSwitch(&AutoResetOptions[0], "ALLOW", "Allow", ISS_OFF);
+    IUFillSwitch(&AutoResetOptions[1], "SUPPRESS", "Suppress", ISS_ON);
+    IUFillSwitchVector(&AutoReset, AutoResetOptions, 2, getDeviceName(), "Arduino Reset On Open", "", CONNECTION_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    IUFillSwitch(&FramingOptions[0], "BINARY", "Binary If Supported", ISS_ON);
+    IUFillSwitch(&FramingOptions[1], "ASCII", "ASCII Only", ISS_OFF);
+    IUFillSwitchVector(&Framing, FramingOptions, 2, getDeviceName(), "Protocol Framing", "", CONNECTION_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    IUFillNumber(&CommandWindowValues[0], "WINDOW", "Commands In Flight", "%0.f", 1, 16, 1, 4);
+    IUFillNumber(&CommandWindowValues[1], "TIMEOUT", "Ack Timeout (ms)", "%0.f", 50, 10000, 50, 500);
+    IUFillNumber(&CommandWindowValues[2], "RETRIES", "Retries", "%0.f", 0, 10, 1, 2);
+    IUFillNumber(&CommandWindowValues[3], "SAFETY_TIMEOUT", "HALT/CLOSE Ack Timeout (ms)", "%0.f", 20, 5000, 10, 200);
+    IUFillNumberVector(&CommandWindow, CommandWindowValues, 4, getDeviceName(), "Command Queue", "", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    IUFillNumber(&TimeoutBudgetValues[0], "BRIGHTNESS", "Brightness Ack Timeout (ms)", "%0.f", 20, 5000, 10, 250);
+    IUFillNumber(&TimeoutBudgetValues[1], "MOTION", "Cover Motion Timeout (s)", "%0.f", 1, 600, 1, 30);
+    IUFillNumber(&TimeoutBudgetValues[2], "REPLY", "Handshake Reply Timeout (ms)", "%0.f", 50, 5000, 50, 300);
+    IUFillNumberVector(&TimeoutBudgets, TimeoutBudgetValues, 3, getDeviceName(), "Timeout Budgets", "", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    IUFillNumber(&StatusPollingValues[0], "ACTIVE", "Active Interval (ms)", "%0.f", 5, 1000, 5, 20);
+    IUFillNumber(&StatusPollingValues[1], "IDLE", "Idle Interval Limit (ms)", "%0.f", 100, 600000, 100, 10000);
+    IUFillNumber(&StatusPollingValues[2], "BACKOFF", "Backoff Factor", "%.1f", 1, 10, 0.5, 2);
+    IUFillNumberVector(&StatusPolling, StatusPollingValues, 3, getDeviceName(), "Status Polling", "", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    IUFillNumber(&BrightnessUpdatesValues[0], "SENT", "Sent", "%0.f", 0, 1e9, 0, 0);
+    IUFillNumber(&BrightnessUpdatesValues[1], "DROPPED", "Superseded", "%0.f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&BrightnessUpdates, BrightnessUpdatesValues, 2, getDeviceName(), "Brightness Updates", "", OPTIONS_TAB, IP_RO, 0, IPS_IDLE);
+
+    return true;
+}
+
+void FlatPanelCover::ISGetProperties(const char *dev)
+{
+    INDI::DefaultDevice::ISGetProperties(dev);
+
+    defineProperty(&ConnectionStatus);
+
+    // Needed before Connect so the cached port can be tried first
+    defineProperty(&TransportMode);
+    defineProperty(&TransportAddress);
+    defineProperty(&PortOverride);
+    defineProperty(&USBIdentity);
+    defineProperty(&AutoReset);
+    defineProperty(&Framing);
+    defineProperty(&CommandWindow);
+    defineProperty(&TimeoutBudgets);
+    defineProperty(&StatusPolling);
+
+    // Every client that attaches asks for the properties; only the first
+    // request loads them, so later clients do not undo unsaved changes
+    if (configLoaded)
+        return;
+    configLoaded = true;
+    loadingConfig = true;
+    loadConfig(true, TransportMode.name);
+    loadConfig(true, TransportAddress.name);
+    loadConfig(true, PortOverride.name);
+    loadConfig(true, USBIdentity.name);
+    loadConfig(true, AutoReset.name);
+    loadConfig(true, Framing.name);
+    loadConfig(true, CommandWindow.name);
+    loadConfig(true, TimeoutBudgets.name);
+    loadConfig(true, StatusPolling.name);
+    loadingConfig = false;
+}
+
+bool FlatPanelCover::saveConfigItems(FILE *fp)
+{
+    INDI::DefaultDevice::saveConfigItems(fp);
+    IUSaveConfigSwitch(fp, &TransportMode);
+    IUSaveConfigText(fp, &TransportAddress);
+    IUSaveConfigText(fp, &PortOverride);
+    IUSaveConfigText(fp, &USBIdentity);
+    IUSaveConfigSwitch(fp, &AutoReset);
+    IUSaveConfigSwitch(fp, &Framing);
+    IUSaveConfigNumber(fp, &CommandWindow);
+    IUSaveConfigNumber(fp, &TimeoutBudgets);
+    IUSaveConfigNumber(fp, &FlatBrightness);
+    IUSaveConfigNumber(fp, &StatusPolling);
     return true;
 }
 
 bool FlatPanelCover::updateProperties()
 {
-    if (isConnected())
+    if (linkReady())
     {
         defineProperty(&CoverControl);
+        defineProperty(&AbortControl);
         defineProperty(&BrightnessControl);
+        defineProperty(&FlatCalibration);
+        defineProperty(&FlatBrightness);
+        loadConfig(true, FlatBrightness.name);
         defineProperty(&StatusFeedback);
+        defineProperty(&LinkSpeed);
+        defineProperty(&BrightnessUpdates);
+        recordPublished(COVER_VECTOR | BRIGHTNESS_VECTOR | STATUS_VECTOR | UPDATES_VECTOR);
+        dirtyVectors = 0;
     }
     else
     {
         deleteProperty(CoverControl.name);
+        deleteProperty(AbortControl.name);
         deleteProperty(BrightnessControl.name);
+        deleteProperty(FlatCalibration.name);
+        deleteProperty(FlatBrightness.name);
         deleteProperty(StatusFeedback.name);
+        deleteProperty(LinkSpeed.name);
+        deleteProperty(BrightnessUpdates.name);
     }
 
     return true;
 }
 
-bool FlatPanelCover::findArduinoPort()
+std::vector<std::string> FlatPanelCover::candidatePorts()
+{
+    static const char *patterns[] = { "/dev/serial/by-id/*", "/dev/ttyUSB*", "/dev/ttyACM*" };
+
+    // by-id links point at the same ttyUSB/ttyACM nodes, so dedupe on the real path
+    std::vector<std::string> ports;
+    std::set<std::string> seen;
+    for (const char *pattern : patterns)
+    {
+        glob_t glob_result;
+        if (glob(pattern, 0, NULL, &glob_result) == 0)
+        {
+            for (size_t i = 0; i < glob_result.gl_pathc; ++i)
+            {
+                char resolved[PATH_MAX];
+                if (realpath(glob_result.gl_pathv[i], resolved) != nullptr && seen.insert(resolved).second)
+                    ports.push_back(resolved);
+            }
+        }
+        globfree(&glob_result);
+    }
+    return ports;
+}
+
+// Opens the port and checks that a flat panel answers. Firmware that knows ID
+// replies "ID PROMETHEUS-FPC <version>"; older firmware is recognised by its
+// reply to STATE. Returns the open descriptor, or -1.
+//
+// A running panel answers the first query within a few milliseconds. If it does
+// not, the open most likely reset the board: bytes sent to the bootloader are
+// lost (and can keep it from starting the sketch), so the probe stays quiet and
+// waits for the firmware's "READY" banner, querying again as soon as it arrives.
+// Firmware without the banner is queried again once the boot window has passed.
+int FlatPanelCover::probePort(const std::string &port, bool suppressReset, const std::atomic<bool> &cancelled)
 {
-    glob_t glob_result;
-    if (glob("/dev/ttyUSB*", 0, NULL, &glob_result) == 0)
+    static constexpr auto probeDeadline = std::chrono::milliseconds(3000);
+    static constexpr auto bootWindow = std::chrono::milliseconds(2200);
+    static constexpr auto queryInterval = std::chrono::milliseconds(500);
+
+    // A port another driver holds (mount, focuser, GPS) is left alone: an open
+    // in exclusive mode fails with EBUSY, and INDI's tty_connect() takes the
+    // same flock. Nothing is configured or written before the lock is ours.
+    int fd = open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == EBUSY)
+            IDLog("Skipping %s: in exclusive use\n", port.c_str());
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
     {
-        for (size_t i = 0; i < glob_result.gl_pathc; ++i)
+        IDLog("Skipping %s: locked by another program\n", port.c_str());
+        close(fd);
+        return -1;
+    }
+    ioctl(fd, TIOCEXCL);
+
+    std::string error;
+    if (!SerialTransport::configure(fd, error))
+    {
+        IDLog("Cannot configure %s: %s\n", port.c_str(), error.c_str());
+        close(fd);
+        return -1;
+    }
+
+    LineFramer<256, 128> framer;
+    auto start = std::chrono::steady_clock::now();
+    auto nextQuery = start;
+    bool firstQuery = true;
+    while (!cancelled)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= start + probeDeadline)
+            break;
+
+        if (now >= nextQuery)
         {
-            serialPort = glob_result.gl_pathv[i];
-            IDLog("Trying port: %s\n", serialPort.c_str());
+            char query[16];
+            int length = snprintf(query, sizeof(query), "%s\n%s\n", protocol::command<protocol::Identify>().data(),
+                                  protocol::command<protocol::QueryState>().data());
+            if (write(fd, query, length) < 0 && errno != EAGAIN)
+                break;
+            nextQuery = firstQuery ? start + bootWindow : now + queryInterval;
+            firstQuery = false;
+        }
 
-            serialFD = open(serialPort.c_str(), O_RDWR | O_NOCTTY);
-            if (serialFD >= 0)
+        auto wait = std::min(nextQuery, start + probeDeadline) - now;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count()) + 1);
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (rc <= 0)
+            continue;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            break;
+
+        size_t space;
+        char *dest = framer.writeSpace(space);
+        ssize_t n = read(fd, dest, space);
+        if (n <= 0)
+            continue;
+        framer.commit(n);
+
+        std::string_view line;
+        while (framer.nextLine(line))
+        {
+            PanelEvent event;
+            ParseResult parsed = parsePanelResponse(line, event);
+            if ((parsed == ParseResult::Reply && startsWith(line, "ID PROMETHEUS-FPC")) ||
+                    (parsed == ParseResult::Event && startsWith(line, protocol::StateReport::keyword)))
             {
-                globfree(&glob_result);
-                return true;
+                IDLog("Flat panel identified on %s: %.*s\n", port.c_str(), static_cast<int>(line.size()), line.data());
+                // Only the panel's line state is changed; other probed devices keep theirs
+                applyResetPolicy(fd, suppressReset);
+                return fd;
+            }
+            if (line == "READY")
+            {
+                IDLog("Panel on %s reset on open, firmware ready after %lld ms\n", port.c_str(),
+                      static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()));
+                nextQuery = std::chrono::steady_clock::now();
             }
         }
     }
 
-    globfree(&glob_result);
-    return false;
+    close(fd);
+    return -1;
 }
 
-bool FlatPanelCover::Connect()
+// Arduino boards reset when DTR falls and rises again. With HUPCL set (the
+// default) close() drops DTR and the next open() raises it, rebooting the panel.
+// Clearing HUPCL keeps DTR asserted across close/open, so only the very first
+// open after the adapter is plugged in can reset the board. Applied once the
+// port is known to be the panel, so it takes effect from the next open.
+void FlatPanelCover::applyResetPolicy(int fd, bool suppressReset)
 {
-    if (!findArduinoPort())
+    struct termios options;
+    if (tcgetattr(fd, &options) != 0)
+        return;
+
+    if (suppressReset)
+        options.c_cflag &= ~HUPCL;
+    else
+        options.c_cflag |= HUPCL;
+    tcsetattr(fd, TCSANOW, &options);
+
+    if (suppressReset)
     {
-        IDLog("No valid serial port found for Arduino.\n");
+        int dtr = TIOCM_DTR;
+        ioctl(fd, TIOCMBIS, &dtr);
+    }
+}
+
+bool FlatPanelCover::readUSBIdentity(const std::string &port, std::string identity[3])
+{
+    static const char *attributes[] = { "idVendor", "idProduct", "serial" };
+
+    char resolved[PATH_MAX];
+    if (realpath(port.c_str(), resolved) == nullptr)
+        return false;
+
+    // /sys/class/tty/<node>/device sits below the USB interface; walk up to the device
+    std::string sysPath = std::string("/sys/class/tty/") + basename(resolved) + "/device";
+    char device[PATH_MAX];
+    if (realpath(sysPath.c_str(), device) == nullptr)
         return false;
+
+    std::string dir = device;
+    while (access((dir + "/idVendor").c_str(), R_OK) != 0)
+    {
+        size_t slash = dir.rfind('/');
+        if (slash == std::string::npos || slash == 0)
+            return false;
+        dir.erase(slash);
     }
 
-    struct termios options;
-    tcgetattr(serialFD, &options);
-    cfsetispeed(&options, B9600);
-    cfsetospeed(&options, B9600);
-    options.c_cflag |= (CLOCAL | CREAD);
-    tcsetattr(serialFD, TCSANOW, &options);
+    for (int i = 0; i < 3; ++i)
+    {
+        identity[i].clear();
+        FILE *attribute = fopen((dir + "/" + attributes[i]).c_str(), "r");
+        if (attribute == nullptr)
+            continue;
+        char value[128];
+        if (fgets(value, sizeof(value), attribute) != nullptr)
+            identity[i] = std::string(value, strcspn(value, "\n"));
+        fclose(attribute);
+    }
+    return !identity[0].empty() && !identity[1].empty();
+}
 
-    IDLog("Connected to Arduino at %s\n", serialPort.c_str());
-    return true;
+std::string FlatPanelCover::findPortByUSBIdentity(const std::string identity[3])
+{
+    static const char *patterns[] = { "/dev/ttyUSB*", "/dev/ttyACM*" };
+
+    for (const char *pattern : patterns)
+    {
+        glob_t glob_result;
+        if (glob(pattern, 0, NULL, &glob_result) == 0)
+        {
+            for (size_t i = 0; i < glob_result.gl_pathc; ++i)
+            {
+                std::string candidate[3];
+                if (readUSBIdentity(glob_result.gl_pathv[i], candidate) &&
+                        candidate[0] == identity[0] && candidate[1] == identity[1] && candidate[2] == identity[2])
+                {
+                    std::string port = glob_result.gl_pathv[i];
+                    globfree(&glob_result);
+                    return port;
+                }
+            }
+        }
+        globfree(&glob_result);
+    }
+    return std::string();
 }
 
-bool FlatPanelCover::Disconnect()
+bool FlatPanelCover::openCachedPort()
 {
-    if (serialFD >= 0)
+    const std::string *identity = linkSettings.identity;
+    if (identity[0].empty() || identity[1].empty())
+        return false;
+
+    std::string port = findPortByUSBIdentity(identity);
+    if (port.empty())
+    {
+        IDLog("Cached panel %s:%s (%s) not present, running full discovery.\n",
+              identity[0].c_str(), identity[1].c_str(), identity[2].c_str());
+        return false;
+    }
+
+    int fd = probePort(port, linkSettings.suppressReset, connectCancelled);
+    if (fd < 0)
     {
-        close(serialFD);
-        serialFD = -1;
+        IDLog("Cached port %s did not verify, running full discovery.\n", port.c_str());
+        return false;
     }
+
+    adoptSerial(fd, port);
     return true;
 }
 
-void FlatPanelCover::TimerHit()
+void FlatPanelCover::rememberUSBIdentity()
 {
-    if (!isConnected())
+    std::string identity[3];
+    if (!readUSBIdentity(linkAddress, identity))
         return;
 
-    char response[128];
-    if (readResponse(response, sizeof(response)))
+    bool changed = false;
+    for (int i = 0; i < 3; ++i)
     {
-        if (strstr(response, "STATE OPEN"))
-        {
-            CoverOptions[0].s = ISS_ON;
-            CoverOptions[1].s = ISS_OFF;
-            IUSaveText(&StatusMessages[0], "Cover Open");
-        }
-        else if (strstr(response, "STATE CLOSED"))
-        {
-            CoverOptions[0].s = ISS_OFF;
-            CoverOptions[1].s = ISS_ON;
-            IUSaveText(&StatusMessages[0], "Cover Closed");
-        }
-        else if (strstr(response, "STATE MOVING"))
-        {
-            IUSaveText(&StatusMessages[0], "Cover Moving...");
-        }
-        else if (strstr(response, "BRIGHTNESS"))
+        if (USBIdentityValues[i].text == nullptr || identity[i] != USBIdentityValues[i].text)
         {
-            BrightnessValue[0].value = atoi(response + 11);
+            IUSaveText(&USBIdentityValues[i], identity[i].c_str());
+            changed = true;
         }
-
-        IDSetSwitch(&CoverControl, nullptr);
-        IDSetNumber(&BrightnessControl, nullptr);
-        IDSetText(&StatusFeedback, nullptr);
+        // Hotplug recovery looks for this device, not the one from before Connect
+        linkSettings.identity[i] = identity[i];
     }
 
-    SetTimer(1000);
+    USBIdentity.s = IPS_OK;
+    IDSetText(&USBIdentity, nullptr);
+    if (changed)
+        saveConfig(true, USBIdentity.name);
 }
 
-bool FlatPanelCover::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+bool FlatPanelCover::findArduinoPort()
 {
-    if (!isConnected() || strcmp(dev, getDeviceName()) != 0)
+    std::vector<std::string> ports;
+    if (!linkSettings.portOverride.empty())
+        ports.push_back(linkSettings.portOverride);
+    else if (openCachedPort())
+        return true;
+    else
+        ports = candidatePorts();
+    if (ports.empty() || connectCancelled)
         return false;
 
-    if (strcmp(name, CoverControl.name) == 0)
+    reportConnectProgress(ports.size() == 1 ? "Probing " + ports[0] + "..." :
+                          "Probing " + std::to_string(ports.size()) + " serial ports...");
+
+    // Probe every candidate at once; connect time is bounded by one probe, not their sum
+    std::mutex probeMutex;
+    std::condition_variable probeDone;
+    std::atomic<bool> found { false };
+    bool suppressReset = linkSettings.suppressReset;
+    size_t remaining = ports.size();
+    int winnerFD = -1;
+    std::string winnerPort;
+
+    std::vector<std::thread> probes;
+    for (const std::string &port : ports)
     {
-        if (strcmp(names[0], "OPEN") == 0 && states[0] == ISS_ON)
+        IDLog("Probing port: %s\n", port.c_str());
+        probes.emplace_back([&, port]()
         {
-            sendCommand("OPEN");
-        }
-        else if (strcmp(names[0], "CLOSE") == 0 && states[1] == ISS_ON)
+            int fd = probePort(port, suppressReset, found);
+
+            std::lock_guard<std::mutex> lock(probeMutex);
+            if (fd >= 0 && !found.exchange(true))
+            {
+                winnerFD = fd;
+                winnerPort = port;
+            }
+            else if (fd >= 0)
+                close(fd);
+            --remaining;
+            probeDone.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(probeMutex);
+        while (!probeDone.wait_for(lock, std::chrono::milliseconds(50), [&]() { return found || remaining == 0; }))
         {
-            sendCommand("CLOSE");
+            // Disconnect while probing: stop the probes, a panel found now is closed again
+            if (connectCancelled)
+                found = true;
         }
+    }
+    for (std::thread &probe : probes)
+        probe.join();
 
-        IDSetSwitch(&CoverControl, nullptr);
-        return true;
+    if (winnerFD < 0)
+        return false;
+
+    adoptSerial(winnerFD, winnerPort);
+    return true;
+}
+
+// The probe needed O_NONBLOCK for open(); the transport clears it
+void FlatPanelCover::adoptSerial(int fd, const std::string &port)
+{
+    std::unique_ptr<SerialTransport> serial(new SerialTransport(port));
+    serial->adopt(fd, port);
+    transport = std::move(serial);
+    linkFD = fd;
+    linkAddress = port;
+}
+
+// Pty, TCP and Unix socket links: the address is given, nothing to discover
+bool FlatPanelCover::openTransport(std::string &error)
+{
+    const std::string &address = linkSettings.address;
+    int mode = linkSettings.mode;
+    if (mode == PanelTransport::PTY)
+        transport.reset(new SerialTransport(address, PanelTransport::PTY));
+    else if (mode == PanelTransport::TCP)
+        transport.reset(new TcpTransport(address));
+    else
+        transport.reset(new UnixTransport(address));
+
+    if (!transport->open(error))
+    {
+        IDLog("Cannot open %s: %s\n", address.c_str(), error.c_str());
+        return false;
     }
+    linkFD = transport->fd();
+    linkAddress = address;
+    return true;
+}
 
-    return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
+void FlatPanelCover::closeLink()
+{
+    if (transport)
+        transport->close();
+    linkFD = -1;
 }
 
-bool FlatPanelCover::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+// Only starts the attempt: true means the connect thread is running, and the
+// CONNECTION switch is settled by finishConnect() once it is done.
+bool FlatPanelCover::Connect()
+{
+    if (connectThread.joinable())
+    {
+        IDLog("Previous connection attempt is still stopping.\n");
+        return false;
+    }
+
+    captureLinkSettings();
+    return startConnectThread();
+}
+
+bool FlatPanelCover::startConnectThread()
 {
-    if (!isConnected() || strcmp(dev, getDeviceName()) != 0)
+    connectEventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (connectEventFD < 0)
+    {
+        IDLog("Failed to create connect eventfd: %s\n", strerror(errno));
         return false;
+    }
+    connectCallbackID = IEAddCallback(connectEventFD, connectEventCallback, this);
 
-    if (strcmp(name, BrightnessControl.name) == 0)
+    connectCancelled = false;
+    connectFinished = false;
+    connectResult = false;
+    connectError.clear();
+    connectProgress.clear();
+    connectThread = std::thread(&FlatPanelCover::connectWorker, this);
+    return true;
+}
+
+void FlatPanelCover::captureLinkSettings()
+{
+    linkSettings.mode = IUFindOnSwitchIndex(&TransportMode);
+    linkSettings.address = TransportAddressValue[0].text ? TransportAddressValue[0].text : "";
+    linkSettings.portOverride = PortOverrideValue[0].text ? PortOverrideValue[0].text : "";
+    for (int i = 0; i < 3; ++i)
+        linkSettings.identity[i] = USBIdentityValues[i].text ? USBIdentityValues[i].text : "";
+    linkSettings.suppressReset = AutoResetOptions[1].s == ISS_ON;
+    linkSettings.binaryFrames = FramingOptions[0].s == ISS_ON;
+    linkSettings.replyTimeout = std::chrono::milliseconds(static_cast<int>(TimeoutBudgetValues[2].value));
+}
+
+// Connect thread. Touches only the link and linkSettings; properties are left
+// to the main thread.
+void FlatPanelCover::connectWorker()
+{
+    bool opened;
+    if (recovering)
     {
-        int brightness = static_cast<int>(values[0]);
-        if (brightness < 0) brightness = 0;
-        if (brightness > 4095) brightness = 4095;
+        std::string error;
+        opened = reopenLink(error);
+        if (!opened)
+            connectError = linkAddress + ": " + error;
+    }
+    else if (linkSettings.mode == PanelTransport::SERIAL)
+    {
+        reportConnectProgress("Searching for the panel...");
+        opened = findArduinoPort();
+        if (!opened)
+            connectError = "no flat panel found on any serial port";
+    }
+    else
+    {
+        reportConnectProgress("Opening " + linkSettings.address + "...");
+        std::string error;
+        opened = openTransport(error);
+        if (!opened)
+            connectError = linkSettings.address + ": " + error;
+    }
 
-        char command[32];
-        snprintf(command, sizeof(command), "BRIGHTNESS %d", brightness);
-        sendCommand(command);
+    if (opened && !connectCancelled)
+    {
+        reportConnectProgress("Panel found on " + linkAddress + ", negotiating link...");
+        connectResult = negotiateLink();
+        if (!connectResult)
+            connectError = "handshake with " + linkAddress + " failed";
+    }
 
-        BrightnessValue[0].value = brightness;
-        IDSetNumber(&BrightnessControl, nullptr);
-        return true;
+    connectFinished = true;
+    reportConnectProgress(std::string());
+}
+
+void FlatPanelCover::reportConnectProgress(const std::string &text)
+{
+    if (!text.empty())
+    {
+        std::lock_guard<std::mutex> lock(connectMutex);
+        connectProgress = text;
     }
 
-    return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
-}
\ No newline at end of file
+    uint64_t one = 1;
+    if (write(connectEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        IDLog("Failed to signal connect progress: %s\n", strerror(errno));
+}
+
+void FlatPanelCover::connectEventCallback(int fd, void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        IDLog("Failed to read connect event counter: %s\n", strerror(errno));
+
+    std::string progress;
+    {
+        std::lock_guard<std::mutex> lock(panel->connectMutex);
+        progress.swap(panel->connectProgress);
+    }
+    // Recovery leaves the link-lost alert up until it succeeds
+    if (!progress.empty() && !panel->connectCancelled && !panel->recovering)
+        panel->setConnectionStatus(progress, IPS_BUSY);
+
+    if (panel->connectFinished)
+        panel->finishConnect();
+}
+
+// Main thread, once the connect thread is done: starts the reader and settles
+// the CONNECTION switch the way DefaultDevice would after a synchronous Connect
+void FlatPanelCover::finishConnect()
+{
+    connectThread.join();
+    IERmCallback(connectCallbackID);
+    connectCallbackID = -1;
+    close(connectEventFD);
+    connectEventFD = -1;
+
+    if (recovering)
+    {
+        finishReconnect();
+        return;
+    }
+
+    if (connectCancelled)
+    {
+        closeLink();
+        connectCancelled = false;
+        IDLog("Connection attempt cancelled.\n");
+        setConnectionStatus("Disconnected", IPS_IDLE);
+        return;
+    }
+
+    // Opened, so the handshake ran, whatever its outcome
+    if (linkFD >= 0)
+        applyNegotiatedLink();
+
+    if (!connectResult || !startLink())
+    {
+        closeLink();
+        if (connectError.empty())
+            connectError = "cannot start the I/O thread";
+        IDLog("Connection failed: %s\n", connectError.c_str());
+        setConnectionStatus("Connection failed: " + connectError, IPS_ALERT);
+        setConnected(false, IPS_ALERT);
+        return;
+    }
+
+    if (transport->kind() == PanelTransport::SERIAL)
+        rememberUSBIdentity();
+    IDLog("Connected to panel at %s\n", linkAddress.c_str());
+    char text[MAXINDINAME * 2];
+    snprintf(text, sizeof(text), "Connected to %s at %.0f baud", linkAddress.c_str(), LinkSpeedValue[0].value);
+    setConnectionStatus(text, IPS_OK);
+    setConnected(true, IPS_OK);
+    updateProperties();
+    flushProperties();
+}
+
+// Disconnect while connecting: the attempt is abandoned at its next check and
+// finishConnect() closes whatever it opened
+void FlatPanelCover::cancelConnect()
+{
+    if (!connectThread.joinable() || connectCancelled)
+        return;
+
+    connectCancelled = true;
+    setConnectionStatus("Cancelling...", IPS_BUSY);
+}
+
+void FlatPanelCover::setConnectionStatus(const std::string &text, IPState state)
+{
+    IUSaveText(&ConnectionStatusValue[0], text.c_str());
+    ConnectionStatus.s = state;
+    IDSetText(&ConnectionStatus, nullptr);
+}
+
+// Connected and past the handshake; the CONNECT switch alone is on while the
+// connect thread still owns the link for Connect. During recovery requests are
+// still taken: they fail as on a lost link and resyncPanel() replays them.
+bool FlatPanelCover::linkReady() const
+{
+    return isConnected() && (!connectThread.joinable() || recovering);
+}
+
+// Brings a freshly opened link up to full speed and learns what the firmware
+// supports. Blocking; runs on the connect thread, for Connect and recovery.
+// Only the link itself is touched; the results go to linkSettings.
+bool FlatPanelCover::negotiateLink()
+{
+    linkSettings.baud = 0;
+    linkSettings.sequenceTags = false;
+    linkSettings.statusQuery = false;
+    linkSettings.pushEvents = false;
+
+    if (transport->kind() == PanelTransport::SERIAL)
+        tuneLowLatency();
+
+    binaryFrames = false;
+    rxFramer.setDelimiter('\n');
+    rxFramer.reset();
+    rxQueue.clear();
+    txQueue.clear();
+    txPriorityQueue.clear();
+    txBytes = 0;
+    ioLinkLost = false;
+
+    // A TCP bridge or socket server keeps the panel at its own rate
+    linkSettings.baud = transport->canSetSpeed() ? negotiateBaudRate() : 9600;
+    // After a cancel every read below fails at once; stop before logging bogus results
+    if (connectCancelled || linkSettings.baud == 0)
+        return false;
+    IDLog("Link on %s running at %d baud\n", linkAddress.c_str(), linkSettings.baud);
+
+    double roundTrip;
+    if (measureRoundTrip(roundTrip))
+        IDLog("Round trip on %s: %.2f ms\n", linkAddress.c_str(), roundTrip);
+    else
+        IDLog("No reply to STATE on %s, round trip not measured.\n", linkAddress.c_str());
+
+    linkSettings.sequenceTags = detectSequenceTags();
+    if (connectCancelled)
+        return false;
+    IDLog("Command acknowledgements %s\n", linkSettings.sequenceTags ? "enabled" :
+          "not supported by firmware, sending unacknowledged");
+
+    linkSettings.statusQuery = queryStatus();
+    if (connectCancelled)
+        return false;
+    IDLog("Status %s\n", linkSettings.statusQuery ? "read with a single STATUS query" : "read with STATE queries");
+
+    linkSettings.pushEvents = enablePushEvents();
+    IDLog("Changes %s\n", linkSettings.pushEvents ? "pushed by firmware, polling disabled" :
+          "polled, firmware does not push them");
+
+    // Binary packets carry the tag, so firmware without tags stays on text
+    if (linkSettings.binaryFrames && linkSettings.sequenceTags && !connectCancelled && !negotiateBinaryFrames())
+        return false;
+    IDLog("Framing %s\n", binaryFrames ? "binary: SLIP packets with CRC-8" : "text lines");
+    return true;
+}
+
+// Main thread. The rate is shown for a failed handshake too, a dead link as an
+// alert; tags restart at 1 on every new link.
+void FlatPanelCover::applyNegotiatedLink()
+{
+    LinkSpeedValue[0].value = linkSettings.baud;
+    LinkSpeed.s = linkSettings.baud > 0 ? IPS_OK : IPS_ALERT;
+    sequenceTags = linkSettings.sequenceTags;
+    statusQuery = linkSettings.statusQuery;
+    pushEvents = linkSettings.pushEvents;
+    statusSequence = -1;
+    nextSequence = 1;
+    linkUpgraded = linkSettings.baud > 9600 || binaryFrames;
+}
+
+// Starts the reader and polling on a negotiated link; main thread only
+bool FlatPanelCover::startLink()
+{
+    if (!startIOThread())
+    {
+        closeLink();
+        return false;
+    }
+    coverMoving = false;
+    schedulePoll(true);
+    return true;
+}
+
+bool FlatPanelCover::setPortSpeed(int baud)
+{
+    std::string error;
+    if (!transport->setSpeed(baud, error))
+    {
+        IDLog("Could not set %d baud on %s: %s\n", baud, linkAddress.c_str(), error.c_str());
+        return false;
+    }
+    rxFramer.reset();
+    return true;
+}
+
+void FlatPanelCover::tuneLowLatency()
+{
+    struct serial_struct serial;
+    if (ioctl(linkFD, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(linkFD, TIOCSSERIAL, &serial) != 0)
+            IDLog("Could not set ASYNC_LOW_LATENCY on %s: %s\n", linkAddress.c_str(), strerror(errno));
+    }
+
+    // FTDI adapters buffer for latency_timer ms (16 by default) before sending a USB packet
+    char resolved[PATH_MAX];
+    if (realpath(linkAddress.c_str(), resolved) == nullptr)
+        return;
+
+    std::string timerPath = std::string("/sys/bus/usb-serial/devices/") + basename(resolved) + "/latency_timer";
+    if (access(timerPath.c_str(), W_OK) != 0)
+        return;
+
+    FILE *timer = fopen(timerPath.c_str(), "w");
+    if (timer == nullptr)
+        return;
+    if (fputs("1", timer) < 0 || fclose(timer) != 0)
+        IDLog("Could not write %s\n", timerPath.c_str());
+    else
+        IDLog("Set %s to 1 ms\n", timerPath.c_str());
+}
+
+// Handshake reads, before the I/O thread owns the link. The deadline is absolute
+// on the monotonic clock, so however many lines arrive and are skipped by the
+// caller, the whole exchange ends on time.
+bool FlatPanelCover::readResponse(std::string_view &response, std::chrono::steady_clock::time_point deadline)
+{
+    while (!nextResponse(response))
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0 || connectCancelled)
+            return false;
+
+        // Short slices so a Disconnect during the connect handshake is noticed quickly
+        remaining = std::min<std::chrono::nanoseconds>(remaining, std::chrono::milliseconds(50));
+        struct timespec timeout = { static_cast<time_t>(remaining.count() / 1000000000), static_cast<long>(remaining.count() % 1000000000) };
+        struct pollfd pfd = { linkFD, POLLIN, 0 };
+        int rc = ppoll(&pfd, 1, &timeout, nullptr);
+        if (rc == 0 || (rc < 0 && errno == EINTR))
+            continue;
+        if (rc < 0 || !(pfd.revents & POLLIN))
+            return false;
+
+        size_t space;
+        char *dest = rxFramer.writeSpace(space);
+        ssize_t n = read(linkFD, dest, space);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            return false;
+        rxFramer.commit(n);
+    }
+    return true;
+}
+
+// Next complete line from rxFramer. In binary mode each frame is checked and
+// unpacked into frameText; one that fails is counted and skipped, so nothing
+// it carried is acted on and the command it acknowledged is sent again when
+// its ack times out.
+bool FlatPanelCover::nextResponse(std::string_view &response)
+{
+    while (rxFramer.nextLine(response))
+    {
+        if (!binaryFrames)
+            return true;
+        if (response.empty())
+            continue;
+        if (protocol::binary::decodeFrame<protocol::binary::ResponseFrames>(response, frameText, sizeof(frameText), response))
+            return true;
+        badFrames++;
+    }
+
+    // A firmware restart drops back to text, and its READY never ends a frame
+    std::string_view pending = rxFramer.pending();
+    if (binaryFrames && (endsWith(pending, "READY\n") || endsWith(pending, "READY\r\n")))
+    {
+        IDLog("Firmware on %s restarted, back to text framing\n", linkAddress.c_str());
+        binaryFrames = false;
+        rxFramer.reset();
+        rxFramer.setDelimiter('\n');
+        response = protocol::command<protocol::Ready>();
+        return true;
+    }
+    return false;
+}
+
+bool FlatPanelCover::expectLine(std::string_view prefix, std::string_view &response, std::chrono::steady_clock::time_point deadline)
+{
+    while (readResponse(response, deadline))
+    {
+        if (startsWith(response, prefix))
+            return true;
+
+        // Status lines interleaved with the handshake still carry state
+        PanelEvent event;
+        if (parsePanelResponse(response, event) == ParseResult::Event)
+            rxQueue.push(event);
+    }
+    return false;
+}
+
+std::chrono::steady_clock::time_point FlatPanelCover::replyDeadline() const
+{
+    return std::chrono::steady_clock::now() + linkSettings.replyTimeout;
+}
+
+// Waits out a firmware timeout in short slices, so a Disconnect during the
+// handshake is not held up. False once the attempt is cancelled.
+bool FlatPanelCover::pauseHandshake(std::chrono::milliseconds duration)
+{
+    auto end = std::chrono::steady_clock::now() + duration;
+    while (!connectCancelled)
+    {
+        auto remaining = end - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::steady_clock::duration::zero())
+            return true;
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(remaining, std::chrono::milliseconds(50)));
+    }
+    return false;
+}
+
+bool FlatPanelCover::verifyEcho()
+{
+    char token[16];
+    snprintf(token, sizeof(token), "%08lx",
+             static_cast<unsigned long>(std::chrono::steady_clock::now().time_since_epoch().count() & 0xffffffff));
+    char command[32];
+    if (protocol::encode<protocol::Echo>(command, sizeof(command), std::string_view(token)) < 0 || !sendHandshake(command))
+        return false;
+
+    std::string_view response;
+    return expectLine(command, response, replyDeadline()) && response == command;
+}
+
+// Firmware baud protocol:
+//   BAUDS            -> "BAUDS 9600 115200 ..." listing supported rates
+//   BAUD <rate>      -> "BAUD <rate>" at the old rate, then the firmware switches
+//   ECHO <token>     -> "ECHO <token>"
+// The firmware returns to 9600 by itself if no valid command arrives at the new
+// rate within one second, so a failed switch never strands the link. Returns the
+// rate in use, or 0 if the link stays dead at 9600 after a failed switch.
+int FlatPanelCover::negotiateBaudRate()
+{
+    static const int candidates[] = { 500000, 230400, 115200 };
+
+    std::string_view response;
+    if (!sendHandshake(protocol::command<protocol::QueryBauds>()) ||
+            !expectLine(protocol::BaudsReply::keyword, response, replyDeadline()))
+    {
+        IDLog("Firmware does not report baud rates, staying at 9600.\n");
+        return 9600;
+    }
+
+    std::string supported(response.substr(protocol::BaudsReply::keyword.size()));
+    supported += ' ';
+
+    for (int baud : candidates)
+    {
+        std::string token = " " + std::to_string(baud) + " ";
+        if (supported.find(token) == std::string::npos)
+            continue;
+
+        char command[32];
+        if (protocol::encode<protocol::SetBaud>(command, sizeof(command), baud) < 0 || !sendHandshake(command) ||
+                !expectLine(command, response, replyDeadline()))
+            continue;
+
+        if (setPortSpeed(baud) && verifyEcho())
+            return baud;
+
+        IDLog("Echo check at %d baud failed, falling back to 9600.\n", baud);
+        setPortSpeed(9600);
+        // Give the firmware time to time out and revert, then confirm the link
+        if (!pauseHandshake(std::chrono::milliseconds(1100)))
+            return 0;
+        if (!verifyEcho())
+        {
+            IDLog("Link did not recover at 9600 after failed switch.\n");
+            return 0;
+        }
+    }
+
+    return 9600;
+}
+
+bool FlatPanelCover::measureRoundTrip(double &milliseconds)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (!sendHandshake(protocol::command<protocol::QueryState>()))
+        return false;
+
+    std::string_view response;
+    PanelEvent event;
+    auto deadline = start + std::chrono::seconds(1);
+    while (readResponse(response, deadline))
+    {
+        if (parsePanelResponse(response, event) != ParseResult::Event)
+            continue;
+
+        milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        // Keep the reply so the initial state reaches the properties
+        rxQueue.push(event);
+        return true;
+    }
+    return false;
+}
+
+// FRAMING BINARY -> "FRAMING BINARY" as text, then both ends use frames. The
+// tagged PING that detected tags confirms them; like a baud switch, the
+// firmware goes back to text by itself if no valid frame comes within a second.
+// False only when the two ends may disagree on the framing, which fails the
+// connect.
+bool FlatPanelCover::negotiateBinaryFrames()
+{
+    char command[32];
+    std::string_view response;
+    if (protocol::encode<protocol::SetFraming>(command, sizeof(command), 1) < 0 || !sendHandshake(command) ||
+            !expectLine(protocol::FramingReply::keyword, response, replyDeadline()) || response != command)
+    {
+        IDLog("Firmware does not offer binary frames.\n");
+        return true;
+    }
+
+    // Anything already read after the reply is framed, so keep the buffer
+    rxFramer.setDelimiter(static_cast<char>(protocol::binary::END));
+    binaryFrames = true;
+    // A lost ack does not mean a lost PING, and a firmware that got one valid
+    // frame stays on frames: probe again, then ask for text in a frame
+    if (detectSequenceTags() || detectSequenceTags())
+        return true;
+
+    bool text = protocol::encode<protocol::SetFraming>(command, sizeof(command), 0) >= 0 && sendHandshake(command) &&
+                expectLine(protocol::FramingReply::keyword, response, replyDeadline()) && response == command;
+    binaryFrames = false;
+    rxFramer.setDelimiter('\n');
+    rxFramer.reset();
+
+    // A firmware that never saw a valid frame went back to text by itself and
+    // answers a text PING, once a newline has flushed the frame from its buffer
+    if (!text)
+    {
+        OutboundLine newline;
+        newline.text[0] = '\n';
+        newline.length = 1;
+        text = pauseHandshake(std::chrono::milliseconds(1100)) && writeLine(newline) && detectSequenceTags();
+    }
+    if (!text)
+    {
+        IDLog("Framing on %s could not be confirmed either way.\n", linkAddress.c_str());
+        return false;
+    }
+    IDLog("Binary frames not confirmed, falling back to text.\n");
+    return true;
+}
+
+// Leaves the firmware on text for whatever opens the port next. Binary frames
+// are only used with tags, so the I/O thread sends FRAMING ASCII like any
+// tagged command and the ack is awaited here, before the thread is stopped.
+void FlatPanelCover::resetFraming()
+{
+    char command[32], tagged[48];
+    if (protocol::encode<protocol::SetFraming>(command, sizeof(command), 0) < 0)
+        return;
+    unsigned sequence = nextSequence;
+    encodeTaggedCommand(tagged, sizeof(tagged), sequence, command);
+    if (!sendCommand(tagged, true))
+        return;
+
+    // Everything else arriving now belongs to a link that is being closed
+    auto deadline = std::chrono::steady_clock::now() + linkSettings.replyTimeout;
+    PanelEvent event;
+    while (!ioLinkLost)
+    {
+        while (rxQueue.pop(event))
+        {
+            if ((event.type == PanelEvent::COMMAND_ACK || event.type == PanelEvent::COMMAND_NAK) &&
+                    event.value == static_cast<int>(sequence))
+            {
+                if (event.type == PanelEvent::COMMAND_NAK)
+                    IDLog("Firmware on %s refused '%s'\n", linkAddress.c_str(), command);
+                return;
+            }
+        }
+        if (rxStalled)
+            wakeIOThread();
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0)
+            break;
+        struct pollfd pfd = { ioEventFD, POLLIN, 0 };
+        uint64_t count;
+        if (poll(&pfd, 1, static_cast<int>(remaining.count())) > 0 && read(ioEventFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            break;
+    }
+    IDLog("No acknowledgement for '%s' on %s; the firmware stays on binary frames until it restarts\n", command,
+          linkAddress.c_str());
+}
+
+bool FlatPanelCover::Disconnect()
+{
+    stopHotplugWatch();
+    if (reconnectTimerID >= 0)
+    {
+        IERmTimer(reconnectTimerID);
+        reconnectTimerID = -1;
+    }
+    cancelSequences("disconnected");
+    stopPolling();
+    cancelCommands();
+
+    // A recovery attempt still owns the link; finishReconnect() closes it
+    if (connectThread.joinable())
+    {
+        connectCancelled = true;
+        reconnectAgain = false;
+        setConnectionStatus("Disconnected", IPS_IDLE);
+        return true;
+    }
+
+    if (binaryFrames)
+        resetFraming();
+    stopIOThread();
+    binaryFrames = false;
+
+    if (malformedLines > 0 || rxFramer.dropped() > 0)
+        IDLog("Discarded %u malformed lines and %zu bytes of line noise from %s\n", malformedLines.load(), rxFramer.dropped(),
+              linkAddress.c_str());
+    if (badFrames > 0)
+        IDLog("Rejected %u corrupted frames from %s\n", badFrames.load(), linkAddress.c_str());
+    if (missedUpdates > 0)
+        IDLog("Missed %u pushed panel updates on %s\n", missedUpdates, linkAddress.c_str());
+    malformedLines = 0;
+    badFrames = 0;
+    missedUpdates = 0;
+    closeLink();
+    setConnectionStatus("Disconnected", IPS_IDLE);
+    return true;
+}
+
+// Main thread. Never blocks: the line is queued for the I/O thread, and a full
+// queue is reported as a failed send so callers can retry or give up. Priority
+// lines are written before anything still waiting in the normal queue. Without
+// the I/O thread the link is closed or still owned by the connect thread, and
+// the send fails as it would on a closed link.
+bool FlatPanelCover::sendCommand(std::string_view cmd, bool priority)
+{
+    if (!ioThread.joinable())
+        return false;
+
+    OutboundLine line;
+    if (!frameCommand(cmd, line))
+    {
+        IDLog("Command '%.*s' cannot be sent %s\n", static_cast<int>(cmd.size()), cmd.data(),
+              binaryFrames ? "as a binary frame" : "(too long)");
+        return false;
+    }
+
+    // Counted first so the I/O thread never subtracts bytes not yet added
+    txBytes += line.length;
+    if (!(priority ? txPriorityQueue.push(line) : txQueue.push(line)))
+    {
+        txBytes -= line.length;
+        IDLog("Serial output queue full, '%.*s' not sent\n", static_cast<int>(cmd.size()), cmd.data());
+        return false;
+    }
+    wakeIOThread();
+    return true;
+}
+
+// Connect thread, before the I/O thread exists: written straight to the link
+bool FlatPanelCover::sendHandshake(std::string_view cmd)
+{
+    OutboundLine line;
+    if (linkFD < 0 || !frameCommand(cmd, line))
+        return false;
+    return writeLine(line);
+}
+
+// The bytes for one command: the line and a newline, or its binary frame
+bool FlatPanelCover::frameCommand(std::string_view cmd, OutboundLine &line) const
+{
+    if (binaryFrames)
+    {
+        int length = protocol::binary::encodeFrame<protocol::binary::CommandFrames>(cmd, line.text, sizeof(line.text));
+        if (length < 0)
+            return false;
+        line.length = static_cast<uint16_t>(length);
+        return true;
+    }
+
+    if (cmd.size() + 1 > sizeof(line.text))
+        return false;
+    memcpy(line.text, cmd.data(), cmd.size());
+    line.text[cmd.size()] = '\n';
+    line.length = static_cast<uint16_t>(cmd.size() + 1);
+    return true;
+}
+
+// Synchronous write for the connect handshake, before the I/O thread exists
+bool FlatPanelCover::writeLine(const OutboundLine &line)
+{
+    size_t written = 0;
+    while (written < line.length)
+    {
+        ssize_t n = write(linkFD, line.text + written, line.length - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            IDLog("Failed to send command on %s: %s\n", linkAddress.c_str(), strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// "#0" is reserved for this check and never used by the queue
+bool FlatPanelCover::detectSequenceTags()
+{
+    std::string_view response;
+    char ping[16];
+    encodeTaggedCommand(ping, sizeof(ping), 0, protocol::command<protocol::Ping>());
+    return sendHandshake(ping) && expectLine("#0 ", response, replyDeadline()) && response == "#0 OK";
+}
+
+// A priority cover command makes any other cover command obsolete, waiting in
+// the queue or already in flight, and is itself never queued: it goes straight
+// to the priority lane whatever the window holds.
+bool FlatPanelCover::queueCommand(QueuedCommand::Target target, std::string_view cmd, bool priority)
+{
+    if (priority && target == QueuedCommand::COVER)
+    {
+        auto isCover = [](const QueuedCommand & queued)
+        {
+            return queued.target == QueuedCommand::COVER;
+        };
+        commandQueue.erase(std::remove_if(commandQueue.begin(), commandQueue.end(), isCover), commandQueue.end());
+        // An OPEN whose ack was lost must not be retried after the HALT or
+        // CLOSE, nor raise an alert when it times out; a late ack is ignored
+        commandsSent.erase(std::remove_if(commandsSent.begin(), commandsSent.end(), isCover), commandsSent.end());
+    }
+
+    if (!sequenceTags)
+        return sendCommand(cmd, priority);
+
+    QueuedCommand command;
+    command.target = target;
+    command.text.assign(cmd);
+    command.priority = priority;
+    command.sequence = 0;
+    command.attempts = 0;
+    command.queued = std::chrono::steady_clock::now();
+
+    if (priority)
+    {
+        sendTagged(command);
+        armCommandTimer();
+        return true;
+    }
+
+    commandQueue.push_back(command);
+    pumpCommands();
+    return true;
+}
+
+void FlatPanelCover::pumpCommands()
+{
+    size_t window = static_cast<size_t>(CommandWindowValues[0].value);
+    size_t inFlight = std::count_if(commandsSent.begin(), commandsSent.end(), [](const QueuedCommand & command)
+    {
+        return !command.priority;
+    });
+
+    while (!commandQueue.empty() && inFlight < window)
+    {
+        QueuedCommand command = commandQueue.front();
+        commandQueue.pop_front();
+        sendTagged(command);
+        inFlight++;
+    }
+
+    armCommandTimer();
+}
+
+void FlatPanelCover::sendTagged(QueuedCommand &command)
+{
+    command.issued = ++commandsIssued;
+    latestIssued[command.target] = command.issued;
+    command.sequence = nextSequence;
+    // A binary frame has one byte for the tag
+    nextSequence = nextSequence % (binaryFrames ? 255 : 9999) + 1;
+
+    char tagged[64];
+    encodeTaggedCommand(tagged, sizeof(tagged), command.sequence, command.text);
+    if (!sendCommand(tagged, command.priority))
+    {
+        failCommand(command, "write failed");
+        return;
+    }
+    command.attempts = 1;
+    command.deadline = std::chrono::steady_clock::now() + commandTimeout(command);
+    commandsSent.push_back(command);
+}
+
+// HALT and CLOSE get the safety budget, BRIGHTNESS its own short one so a
+// dragged slider notices a dead link quickly, everything else the ack timeout
+std::chrono::milliseconds FlatPanelCover::commandTimeout(const QueuedCommand &command) const
+{
+    double budget = CommandWindowValues[1].value;
+    if (command.priority)
+        budget = CommandWindowValues[3].value;
+    else if (command.target == QueuedCommand::BRIGHTNESS)
+        budget = TimeoutBudgetValues[0].value;
+    return std::chrono::milliseconds(static_cast<int>(budget));
+}
+
+bool FlatPanelCover::commandsInFlight(QueuedCommand::Target target) const
+{
+    for (const QueuedCommand &command : commandsSent)
+        if (command.target == target)
+            return true;
+    for (const QueuedCommand &command : commandQueue)
+        if (command.target == target)
+            return true;
+    return false;
+}
+
+// A newer command for the same target has been sent since this one
+bool FlatPanelCover::superseded(const QueuedCommand &command) const
+{
+    return latestIssued[command.target] != command.issued;
+}
+
+void FlatPanelCover::completeCommand(unsigned sequence, bool success)
+{
+    for (auto it = commandsSent.begin(); it != commandsSent.end(); ++it)
+    {
+        if (it->sequence != sequence)
+            continue;
+
+        QueuedCommand command = *it;
+        commandsSent.erase(it);
+
+        if (!success)
+        {
+            // The newer command decides the outcome for this target
+            if (superseded(command))
+                IDLog("'%s' rejected by firmware, already superseded\n", command.text.c_str());
+            else
+                failCommand(command, "rejected by firmware");
+            break;
+        }
+
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - command.queued).count();
+        IDLog("'%s' acknowledged after %.2f ms (%d attempt%s)\n", command.text.c_str(), elapsed, command.attempts,
+              command.attempts == 1 ? "" : "s");
+        if (command.priority && elapsed > CommandWindowValues[3].value)
+            IDLog("'%s' exceeded the %.0f ms safety budget\n", command.text.c_str(), CommandWindowValues[3].value);
+
+        // The reply to OPEN or CLOSE came before its ack and may be an older
+        // report; ask again so a cover that was already there completes too
+        if (command.target == QueuedCommand::COVER && !superseded(command) && coverReportStale)
+        {
+            coverReportStale = false;
+            sendCommand(statusQuery ? protocol::command<protocol::QueryStatus>() : protocol::command<protocol::QueryState>());
+        }
+
+        // Brightness is applied on ack; the cover completes when STATE reports it
+        if (command.target == QueuedCommand::BRIGHTNESS && pendingBrightness < 0 && !commandsInFlight(QueuedCommand::BRIGHTNESS))
+            BrightnessControl.s = IPS_OK;
+        break;
+    }
+
+    pumpBrightness();
+    pumpCommands();
+}
+
+void FlatPanelCover::failCommand(const QueuedCommand &command, const std::string &reason)
+{
+    IDLog("'%s' failed: %s\n", command.text.c_str(), reason.c_str());
+    if (command.target == QueuedCommand::COVER)
+    {
+        if (!superseded(command))
+            coverReportStale = false;
+        CoverControl.s = IPS_ALERT;
+        coverMessage = command.text + " failed: " + reason;
+        markDirty(COVER_VECTOR);
+    }
+    else if (command.target == QueuedCommand::BRIGHTNESS)
+    {
+        BrightnessControl.s = IPS_ALERT;
+        brightnessMessage = command.text + " failed: " + reason;
+        markDirty(BRIGHTNESS_VECTOR);
+        pumpBrightness();
+    }
+    else
+    {
+        queryTimedOut = true;
+        StatusFeedback.s = IPS_ALERT;
+        markDirty(STATUS_VECTOR);
+    }
+}
+
+void FlatPanelCover::cancelCommands()
+{
+    commandQueue.clear();
+    commandsSent.clear();
+    pendingBrightness = -1;
+    coverReportStale = false;
+    if (commandTimerID >= 0)
+    {
+        IERmTimer(commandTimerID);
+        commandTimerID = -1;
+    }
+    if (brightnessTimerID >= 0)
+    {
+        IERmTimer(brightnessTimerID);
+        brightnessTimerID = -1;
+    }
+    stopMotionTimer();
+}
+
+void FlatPanelCover::requestBrightness(int brightness)
+{
+    if (pendingBrightness >= 0)
+        BrightnessUpdatesValues[1].value++;
+    pendingBrightness = brightness;
+    pumpBrightness();
+}
+
+// With acknowledgements a BRIGHTNESS is in flight until its ack. Without them it
+// is in flight while bytes are still in the UART output queue (TIOCOUTQ, which
+// is the unsent socket send queue on network transports).
+void FlatPanelCover::pumpBrightness()
+{
+    if (pendingBrightness < 0 || brightnessTimerID >= 0)
+        return;
+
+    if (sequenceTags)
+    {
+        if (commandsInFlight(QueuedCommand::BRIGHTNESS))
+            return;
+    }
+    else
+    {
+        // Still waiting in our queue or already in the UART
+        int queued = 0;
+        if (ioThread.joinable() && ioctl(linkFD, TIOCOUTQ, &queued) != 0)
+            queued = 0;
+        queued += static_cast<int>(txBytes.load());
+        if (queued > 0)
+        {
+            // Roughly 10 bits per byte on the wire
+            int drainMs = queued * 10000 / std::max(static_cast<int>(LinkSpeedValue[0].value), 1) + 1;
+            brightnessTimerID = IEAddTimer(drainMs, brightnessTimerCallback, this);
+            return;
+        }
+    }
+
+    char command[32];
+    protocol::encode<protocol::SetBrightness>(command, sizeof(command), pendingBrightness);
+    pendingBrightness = -1;
+    // Counted as sent only once it is queued; without acks a failed write is
+    // the only failure the client will hear about
+    if (!queueCommand(QueuedCommand::BRIGHTNESS, command))
+    {
+        if (!sequenceTags)
+        {
+            BrightnessControl.s = IPS_ALERT;
+            brightnessMessage = std::string(command) + " failed: write failed";
+            markDirty(BRIGHTNESS_VECTOR);
+        }
+        return;
+    }
+
+    // Unacknowledged links have nothing more to wait for once the command is written
+    if (!sequenceTags && BrightnessControl.s == IPS_BUSY)
+        BrightnessControl.s = IPS_OK;
+
+    BrightnessUpdatesValues[0].value++;
+}
+
+void FlatPanelCover::brightnessTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->brightnessTimerID = -1;
+    panel->pumpBrightness();
+    panel->flushProperties();
+}
+
+void FlatPanelCover::armCommandTimer()
+{
+    if (commandTimerID >= 0)
+    {
+        IERmTimer(commandTimerID);
+        commandTimerID = -1;
+    }
+    if (commandsSent.empty())
+        return;
+
+    auto earliest = commandsSent.front().deadline;
+    for (const QueuedCommand &command : commandsSent)
+        earliest = std::min(earliest, command.deadline);
+
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(earliest - std::chrono::steady_clock::now()).count();
+    commandTimerID = IEAddTimer(static_cast<int>(std::max<long long>(wait, 0)) + 1, commandTimerCallback, this);
+}
+
+void FlatPanelCover::commandTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->commandTimerID = -1;
+    panel->checkCommandTimeouts();
+    panel->flushProperties();
+}
+
+// Commands are idempotent (OPEN, CLOSE, BRIGHTNESS n), so a retry reuses the
+// sequence number and a late ack for the first attempt still completes it.
+// Repeating a command is only safe while it is the newest for its target:
+// resent after a later one, the firmware would run them out of order (SET 10,
+// SET 200, SET 10 again). A timed-out command that has been superseded is
+// dropped instead, neither retried nor reported as failed.
+void FlatPanelCover::checkCommandTimeouts()
+{
+    auto now = std::chrono::steady_clock::now();
+    int retries = static_cast<int>(CommandWindowValues[2].value);
+
+    for (auto it = commandsSent.begin(); it != commandsSent.end();)
+    {
+        if (it->deadline > now)
+        {
+            ++it;
+            continue;
+        }
+
+        if (superseded(*it))
+        {
+            IDLog("'%s' unacknowledged and superseded, not retried\n", it->text.c_str());
+            it = commandsSent.erase(it);
+            continue;
+        }
+
+        if (it->attempts > retries)
+        {
+            QueuedCommand command = *it;
+            it = commandsSent.erase(it);
+            failCommand(command, "no acknowledgement within " + std::to_string(commandTimeout(command).count()) + " ms");
+            continue;
+        }
+
+        char tagged[64];
+        encodeTaggedCommand(tagged, sizeof(tagged), it->sequence, it->text);
+        sendCommand(tagged, it->priority);
+        it->attempts++;
+        it->deadline = now + commandTimeout(*it);
+        ++it;
+    }
+
+    pumpCommands();
+}
+
+// What a client's Cover Control switch does; position 0 opens, 1 closes
+void FlatPanelCover::commandCover(int position)
+{
+    requestedCover = position;
+    reportedCover = -1;
+    coverReportStale = true;
+    coverReportsFrom = eventsSeen + rxQueue.size();
+    if (position == 0)
+        queueCommand(QueuedCommand::COVER, protocol::command<protocol::Open>());
+    else
+        queueCommand(QueuedCommand::COVER, protocol::command<protocol::Close>(), true);
+
+    IUResetSwitch(&CoverControl);
+    CoverOptions[position].s = ISS_ON;
+    // Busy until the position is reported, acknowledged or not; the motion
+    // budget turns a cover that never gets there into an alert
+    CoverControl.s = IPS_BUSY;
+    armMotionTimer();
+    schedulePoll(true);
+    markDirty(COVER_VECTOR);
+}
+
+void FlatPanelCover::commandBrightness(int brightness)
+{
+    requestBrightness(brightness);
+
+    requestedBrightness = brightness;
+    BrightnessValue[0].value = brightness;
+    BrightnessControl.s = (sequenceTags || pendingBrightness >= 0) ? IPS_BUSY : IPS_OK;
+    markDirty(BRIGHTNESS_VECTOR);
+}
+
+// Sequences run alongside each other; an owner that allows only one of its
+// own at a time cancels the previous one first
+void FlatPanelCover::runSequence(PanelSequence sequence)
+{
+    sequences.push_back(std::move(sequence));
+    advanceSequences();
+}
+
+void FlatPanelCover::cancelSequence(const std::string &name, const std::string &reason)
+{
+    for (PanelSequence &sequence : sequences)
+        if (sequence.name() == name)
+            sequence.cancel(reason);
+}
+
+void FlatPanelCover::advanceSequences()
+{
+    if (sequenceTimerID >= 0)
+    {
+        IERmTimer(sequenceTimerID);
+        sequenceTimerID = -1;
+    }
+
+    auto now = PanelSequence::Clock::now();
+    for (auto it = sequences.begin(); it != sequences.end();)
+    {
+        if (it->advance(now) != PanelSequence::RUNNING)
+            it = sequences.erase(it);
+        else
+            ++it;
+    }
+    if (sequences.empty())
+        return;
+
+    // Only timeouts need the timer; progress arrives with panel events
+    auto earliest = sequences.front().deadline();
+    for (const PanelSequence &sequence : sequences)
+        earliest = std::min(earliest, sequence.deadline());
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(earliest - now).count();
+    sequenceTimerID = IEAddTimer(static_cast<int>(std::max<long long>(wait, 0)) + 1, sequenceTimerCallback, this);
+}
+
+void FlatPanelCover::cancelSequences(const std::string &reason)
+{
+    if (sequenceTimerID >= 0)
+    {
+        IERmTimer(sequenceTimerID);
+        sequenceTimerID = -1;
+    }
+    std::deque<PanelSequence> cancelled;
+    cancelled.swap(sequences);
+    for (PanelSequence &sequence : cancelled)
+        sequence.cancel(reason);
+}
+
+void FlatPanelCover::sequenceTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->sequenceTimerID = -1;
+    panel->flushProperties();
+}
+
+// Done once the position is reported after the command; a motion timeout, a NAK or a client
+// moving the cover elsewhere fails the step
+PanelSequence::Step FlatPanelCover::coverStep(int position)
+{
+    PanelSequence::Step step;
+    step.label = position == 0 ? "OPEN" : "CLOSE";
+    step.start = [this, position]()
+    {
+        commandCover(position);
+        return true;
+    };
+    step.poll = [this, position]()
+    {
+        // The last reported position is stale while the cover travels
+        if (reportedCover == position && !coverMoving)
+            return PanelSequence::DONE;
+        if (requestedCover != position || CoverControl.s == IPS_ALERT)
+            return PanelSequence::FAILED;
+        return PanelSequence::PENDING;
+    };
+    // The motion timer raises the alert first; this is only the backstop
+    step.timeout = std::chrono::milliseconds(static_cast<int>(TimeoutBudgetValues[1].value * 1000 + CommandWindowValues[1].value));
+    return step;
+}
+
+// Done once the level is acknowledged, or written on firmware without acks
+PanelSequence::Step FlatPanelCover::brightnessStep(int brightness)
+{
+    PanelSequence::Step step;
+    step.label = "BRIGHTNESS " + std::to_string(brightness);
+    step.start = [this, brightness]()
+    {
+        commandBrightness(brightness);
+        return true;
+    };
+    step.poll = [this]()
+    {
+        if (BrightnessControl.s == IPS_ALERT)
+            return PanelSequence::FAILED;
+        if (pendingBrightness >= 0 || brightnessTimerID >= 0 || commandsInFlight(QueuedCommand::BRIGHTNESS))
+            return PanelSequence::PENDING;
+        return PanelSequence::DONE;
+    };
+    // Every attempt may use its whole ack budget
+    step.timeout = std::chrono::milliseconds(static_cast<int>(TimeoutBudgetValues[0].value * (CommandWindowValues[2].value + 1)) + 1000);
+    return step;
+}
+
+// START: close, wait for CLOSED, light at the flat level, wait for the ack.
+// STOP: light off first so the sky never sees the panel lit, then open.
+PanelSequence::Body FlatPanelCover::flatCalibration(bool lightOn)
+{
+    if (lightOn)
+    {
+        int level = static_cast<int>(FlatBrightnessValue[0].value);
+        co_await coverStep(1);
+        co_await brightnessStep(level);
+    }
+    else
+    {
+        co_await brightnessStep(0);
+        co_await coverStep(0);
+    }
+}
+
+void FlatPanelCover::startFlatCalibration(bool lightOn)
+{
+    // STOP while START is still closing the cover, or the other way round
+    cancelSequence(FlatCalibration.name, "superseded");
+
+    IUResetSwitch(&FlatCalibration);
+    FlatCalibrationOptions[lightOn ? 0 : 1].s = ISS_ON;
+    FlatCalibration.s = IPS_BUSY;
+    IDSetSwitch(&FlatCalibration, nullptr);
+
+    runSequence(PanelSequence(FlatCalibration.name, flatCalibration(lightOn), [this, lightOn](bool success, const std::string & error)
+    {
+        FlatCalibration.s = success ? IPS_OK : IPS_ALERT;
+        if (success)
+            IDSetSwitch(&FlatCalibration, lightOn ? "Panel closed and lit for flats" : "Panel dark and open");
+        else
+        {
+            IDLog("Flat calibration %s: %s\n", lightOn ? "start" : "stop", error.c_str());
+            IDSetSwitch(&FlatCalibration, "%s", error.c_str());
+        }
+    }));
+}
+
+void FlatPanelCover::armMotionTimer()
+{
+    stopMotionTimer();
+    motionTimerID = IEAddTimer(static_cast<int>(TimeoutBudgetValues[1].value * 1000), motionTimerCallback, this);
+}
+
+void FlatPanelCover::stopMotionTimer()
+{
+    if (motionTimerID >= 0)
+    {
+        IERmTimer(motionTimerID);
+        motionTimerID = -1;
+    }
+}
+
+void FlatPanelCover::motionTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->motionTimerID = -1;
+    if (panel->requestedCover >= 0 && panel->reportedCover != panel->requestedCover)
+    {
+        IDLog("Cover did not reach %s within %.0f s\n", panel->requestedCover == 0 ? "OPEN" : "CLOSED",
+              panel->TimeoutBudgetValues[1].value);
+        panel->CoverControl.s = IPS_ALERT;
+        char message[64];
+        snprintf(message, sizeof(message), "Cover did not finish %s within %.0f s",
+                 panel->requestedCover == 0 ? "opening" : "closing", panel->TimeoutBudgetValues[1].value);
+        panel->coverMessage = message;
+        panel->markDirty(COVER_VECTOR);
+    }
+    panel->flushProperties();
+}
+
+bool FlatPanelCover::startIOThread()
+{
+    ioWakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ioEventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ioWakeFD < 0 || ioEventFD < 0)
+    {
+        IDLog("Failed to create I/O thread eventfd: %s\n", strerror(errno));
+        stopIOThread();
+        return false;
+    }
+
+    // The thread must never sit in write() while it should be reading or stopping
+    fcntl(linkFD, F_SETFL, fcntl(linkFD, F_GETFL) | O_NONBLOCK);
+    unparsedBytes = 0;
+    rxStalled = false;
+    ioLinkLost = false;
+
+    ioCallbackID = IEAddCallback(ioEventFD, ioEventCallback, this);
+    ioRunning = true;
+    ioThread = std::thread(&FlatPanelCover::ioThreadLoop, this);
+
+    // Deliver anything parsed during the connect handshake
+    if (!rxQueue.empty())
+        wakeMainLoop();
+    return true;
+}
+
+void FlatPanelCover::stopIOThread()
+{
+    if (ioThread.joinable())
+    {
+        ioRunning = false;
+        wakeIOThread();
+        ioThread.join();
+    }
+
+    if (ioCallbackID >= 0)
+    {
+        IERmCallback(ioCallbackID);
+        ioCallbackID = -1;
+    }
+    if (ioWakeFD >= 0)
+    {
+        close(ioWakeFD);
+        ioWakeFD = -1;
+    }
+    if (ioEventFD >= 0)
+    {
+        close(ioEventFD);
+        ioEventFD = -1;
+    }
+
+    // Unsent lines belong to a link that is going away
+    txQueue.clear();
+    txPriorityQueue.clear();
+    txBytes = 0;
+    if (linkFD >= 0)
+        fcntl(linkFD, F_SETFL, fcntl(linkFD, F_GETFL) & ~O_NONBLOCK);
+}
+
+void FlatPanelCover::wakeIOThread()
+{
+    uint64_t one = 1;
+    if (ioWakeFD >= 0 && write(ioWakeFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        IDLog("Failed to wake I/O thread: %s\n", strerror(errno));
+}
+
+void FlatPanelCover::wakeMainLoop()
+{
+    uint64_t one = 1;
+    if (ioEventFD >= 0 && write(ioEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        IDLog("Failed to signal main loop: %s\n", strerror(errno));
+}
+
+// Parses every complete line in rxFramer into rxQueue. Returns false with the
+// event kept in stalledEvent when the queue is full; the remaining lines stay
+// in the framer and linkFD is not read again until the main loop catches up.
+bool FlatPanelCover::drainLines()
+{
+    if (rxStalled)
+    {
+        if (!rxQueue.push(stalledEvent))
+            return false;
+        rxStalled = false;
+    }
+
+    std::string_view response;
+    while (nextResponse(response))
+    {
+        PanelEvent event;
+        ParseResult result = parsePanelResponse(response, event);
+        if (result == ParseResult::Malformed)
+            malformedLines++;
+        else
+            unparsedBytes = 0;
+        if (result != ParseResult::Event)
+            continue;
+
+        if (!rxQueue.push(event))
+        {
+            stalledEvent = event;
+            rxStalled = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void FlatPanelCover::ioThreadLoop()
+{
+    OutboundLine writing;
+    size_t written = 0;
+    bool haveLine = false;
+    bool linkLost = false;
+
+    while (ioRunning && !linkLost)
+    {
+        // Write queued lines until done or the UART pushes back. A line already
+        // started is finished first; the priority lane goes before the rest.
+        while (haveLine || txPriorityQueue.pop(writing) || txQueue.pop(writing))
+        {
+            if (!haveLine)
+            {
+                haveLine = true;
+                written = 0;
+            }
+            ssize_t n = write(linkFD, writing.text + written, writing.length - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                {
+                    IDLog("Serial write on %s failed: %s\n", linkAddress.c_str(), strerror(errno));
+                    linkLost = true;
+                }
+                break;
+            }
+            written += n;
+            txBytes -= n;
+            if (written == writing.length)
+                haveLine = false;
+        }
+        if (linkLost)
+            break;
+
+        // Sleep until the panel sends something, the UART drains, there is
+        // something to send or we are asked to stop; no timeout
+        struct pollfd fds[2];
+        fds[0] = { linkFD, static_cast<short>((rxStalled ? 0 : POLLIN) | (haveLine ? POLLOUT : 0)), 0 };
+        fds[1] = { ioWakeFD, POLLIN, 0 };
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            IDLog("Serial poll failed: %s\n", strerror(errno));
+            linkLost = true;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(ioWakeFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                IDLog("Failed to read I/O wake counter: %s\n", strerror(errno));
+        }
+
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            IDLog("Serial port %s hung up.\n", linkAddress.c_str());
+            linkLost = true;
+            break;
+        }
+
+        // Woken after the main loop made room: resume with the lines already framed
+        if (rxStalled)
+        {
+            size_t before = rxQueue.size();
+            drainLines();
+            if (rxQueue.size() != before)
+                wakeMainLoop();
+            continue;
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        size_t space;
+        char *dest = rxFramer.writeSpace(space);
+        ssize_t n = read(linkFD, dest, space);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+        {
+            IDLog("Serial read on %s failed: %s\n", linkAddress.c_str(), n == 0 ? "EOF" : strerror(errno));
+            linkLost = true;
+            break;
+        }
+        rxFramer.commit(n);
+        unparsedBytes += n;
+
+        // Drain every complete line in this chunk before reading again
+        size_t before = rxQueue.size();
+        drainLines();
+        if (rxQueue.size() != before || rxStalled)
+            wakeMainLoop();
+
+        if (linkUpgraded && unparsedBytes >= RestartNoise)
+        {
+            IDLog("%zu bytes of noise from %s, the firmware probably restarted.\n", unparsedBytes, linkAddress.c_str());
+            linkLost = true;
+            break;
+        }
+    }
+
+    if (linkLost)
+    {
+        ioLinkLost = true;
+        wakeMainLoop();
+    }
+}
+
+void FlatPanelCover::ioEventCallback(int fd, void *userpointer)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        IDLog("Failed to read I/O event counter: %s\n", strerror(errno));
+
+    static_cast<FlatPanelCover *>(userpointer)->processEvents();
+}
+
+void FlatPanelCover::processEvents()
+{
+    // Bounded to what was queued on entry, so a chatty panel cannot starve the loop
+    size_t available = rxQueue.size();
+    bool linkLost = ioLinkLost.exchange(false);
+    if (available == 0 && !linkLost)
+        return;
+
+    bool firmwareRestarted = false;
+    bool wasMoving = coverMoving;
+    PanelEvent event;
+    for (size_t i = 0; i < available && rxQueue.pop(event); ++i)
+    {
+        if (++eventsSeen > coverReportsFrom && !sequenceTags)
+            coverReportStale = false;
+
+        switch (event.type)
+        {
+            case PanelEvent::COVER_OPEN:
+            case PanelEvent::COVER_CLOSED:
+            case PanelEvent::COVER_MOVING:
+            case PanelEvent::COVER_HALTED:
+                applyCoverEvent(event.type);
+                pollOutstanding = false;
+                break;
+            case PanelEvent::BRIGHTNESS:
+                BrightnessValue[0].value = event.value;
+                reportedBrightness = event.value;
+                break;
+            case PanelEvent::STATUS:
+                applyStatus(event);
+                pollOutstanding = false;
+                break;
+            case PanelEvent::FIRMWARE_READY:
+                // The board rebooted under us (brown-out, watchdog): brightness is gone
+                IDLog("Panel firmware restarted, %s.\n", linkUpgraded ? "negotiating the link again" : "resending last requests");
+                firmwareRestarted = true;
+                break;
+            case PanelEvent::FIRMWARE_ERROR:
+                IDLog("Panel reported an error for an untagged command.\n");
+                break;
+            case PanelEvent::COMMAND_ACK:
+            case PanelEvent::COMMAND_NAK:
+                completeCommand(event.value, event.type == PanelEvent::COMMAND_ACK);
+                break;
+        }
+    }
+
+    // The reader stopped at a full queue; there is room again
+    if (rxStalled)
+        wakeIOThread();
+
+    // Only a link that never left 9600 baud and text can carry on as it is
+    if (firmwareRestarted && !linkLost)
+    {
+        if (linkUpgraded)
+            linkLost = true;
+        else
+            resyncPanel();
+    }
+
+    // A cover command is complete once the firmware reports the requested position
+    if (reportedCover >= 0 && reportedCover == requestedCover && !coverMoving)
+    {
+        stopMotionTimer();
+        if (CoverControl.s == IPS_BUSY)
+            CoverControl.s = IPS_OK;
+    }
+
+    if (queryTimedOut && available > 0)
+    {
+        queryTimedOut = false;
+        StatusFeedback.s = resyncPending ? IPS_BUSY : IPS_OK;
+    }
+
+    if (resyncPending)
+        checkResync();
+
+    if (coverMoving && !wasMoving)
+        schedulePoll(true);
+
+    // After the events, so the reader has already exited and nothing else is queued
+    if (linkLost)
+        handleLinkLost();
+
+    flushProperties();
+}
+
+// Older firmware answers "ERR UNKNOWN" and is read with STATE instead. The
+// snapshot is kept so the initial state reaches the properties.
+bool FlatPanelCover::queryStatus()
+{
+    std::string_view response;
+    if (!sendHandshake(protocol::command<protocol::QueryStatus>()) ||
+            !expectLine(protocol::StatusReport::keyword, response, replyDeadline()))
+        return false;
+
+    PanelEvent event;
+    if (parsePanelResponse(response, event) != ParseResult::Event)
+        return false;
+    rxQueue.push(event);
+    return true;
+}
+
+// Legacy firmware answers "ERR UNKNOWN" and is polled instead
+bool FlatPanelCover::enablePushEvents()
+{
+    char command[16];
+    if (protocol::encode<protocol::SetEvents>(command, sizeof(command), 1) < 0 || !sendHandshake(command))
+        return false;
+
+    std::string_view response;
+    return expectLine(protocol::EventsReply::keyword, response, replyDeadline()) && response == command;
+}
+
+bool FlatPanelCover::pollingActive() const
+{
+    return coverMoving || CoverControl.s == IPS_BUSY || !commandsSent.empty() || !commandQueue.empty();
+}
+
+// reset: something just happened (client request, motion started), so poll at
+// the active rate from now on instead of waiting out a long idle interval
+void FlatPanelCover::schedulePoll(bool reset)
+{
+    if (pollTimerID >= 0)
+    {
+        if (!reset)
+            return;
+        IERmTimer(pollTimerID);
+        pollTimerID = -1;
+    }
+    if (pushEvents || !ioThread.joinable())
+        return;
+
+    if (reset || pollingActive() || pollInterval <= 0)
+        pollInterval = std::max(static_cast<int>(StatusPollingValues[0].value), pollReplyMs());
+    pollTimerID = IEAddTimer(pollInterval, pollTimerCallback, this);
+}
+
+void FlatPanelCover::stopPolling()
+{
+    if (pollTimerID >= 0)
+    {
+        IERmTimer(pollTimerID);
+        pollTimerID = -1;
+    }
+    pollInterval = 0;
+    pollOutstanding = false;
+}
+
+// Time the reply to one poll spends on the wire, 10 bits per byte. At 9600
+// baud a STATUS line takes longer than the default active interval.
+int FlatPanelCover::pollReplyMs() const
+{
+    size_t bytes = statusQuery ? sizeof("STATUS MOVING 4095 OFF 100 65535\r\n") : sizeof("STATE MOVING\r\n");
+    return static_cast<int>(bytes * 10000 / std::max(static_cast<int>(LinkSpeedValue[0].value), 1)) + 1;
+}
+
+// An untagged STATE: the reply arrives as an ordinary event and never occupies
+// a slot in the command window. A tick while the last reply is still due sends
+// nothing, so a slow link cannot build up a backlog of replies in the firmware;
+// a reply lost on the way is given up on after the handshake reply budget.
+void FlatPanelCover::pollTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->pollTimerID = -1;
+    auto now = std::chrono::steady_clock::now();
+    if (!panel->pollOutstanding || now >= panel->pollDeadline)
+    {
+        if (panel->sendCommand(panel->statusQuery ? protocol::command<protocol::QueryStatus>() :
+                               protocol::command<protocol::QueryState>()))
+        {
+            panel->pollOutstanding = true;
+            panel->pollDeadline = now + std::chrono::milliseconds(panel->pollReplyMs() +
+                                  static_cast<int>(panel->TimeoutBudgetValues[2].value));
+        }
+    }
+
+    if (!panel->pollingActive())
+    {
+        double next = panel->pollInterval * panel->StatusPollingValues[2].value;
+        panel->pollInterval = static_cast<int>(std::min(next, panel->StatusPollingValues[1].value));
+    }
+    panel->schedulePoll(false);
+}
+
+void FlatPanelCover::markDirty(unsigned vectors)
+{
+    dirtyVectors |= vectors;
+}
+
+void FlatPanelCover::recordPublished(unsigned vectors)
+{
+    if (vectors & COVER_VECTOR)
+    {
+        published.cover[0] = CoverOptions[0].s;
+        published.cover[1] = CoverOptions[1].s;
+        published.coverState = CoverControl.s;
+    }
+    if (vectors & BRIGHTNESS_VECTOR)
+    {
+        published.brightness = BrightnessValue[0].value;
+        published.brightnessState = BrightnessControl.s;
+    }
+    if (vectors & STATUS_VECTOR)
+    {
+        published.status = StatusMessages[0].text;
+        published.statusState = StatusFeedback.s;
+    }
+    if (vectors & UPDATES_VECTOR)
+    {
+        published.updates[0] = BrightnessUpdatesValues[0].value;
+        published.updates[1] = BrightnessUpdatesValues[1].value;
+    }
+}
+
+// Called at the end of every event loop entry point, so all changes made while
+// handling one batch of events, one timer or one client request go out together.
+void FlatPanelCover::flushProperties()
+{
+    if (!linkReady())
+    {
+        dirtyVectors = 0;
+        coverMessage.clear();
+        brightnessMessage.clear();
+        return;
+    }
+
+    // Sequences see every change made in this pass, and what their next steps
+    // start goes out with it
+    advanceSequences();
+
+    unsigned changed = dirtyVectors;
+    dirtyVectors = 0;
+    if (CoverOptions[0].s != published.cover[0] || CoverOptions[1].s != published.cover[1] ||
+            CoverControl.s != published.coverState)
+        changed |= COVER_VECTOR;
+    if (BrightnessValue[0].value != published.brightness || BrightnessControl.s != published.brightnessState)
+        changed |= BRIGHTNESS_VECTOR;
+    if (published.status != StatusMessages[0].text || StatusFeedback.s != published.statusState)
+        changed |= STATUS_VECTOR;
+    if (BrightnessUpdatesValues[0].value != published.updates[0] || BrightnessUpdatesValues[1].value != published.updates[1])
+        changed |= UPDATES_VECTOR;
+
+    if (changed == 0)
+        return;
+    recordPublished(changed);
+
+    if (changed & COVER_VECTOR)
+    {
+        if (coverMessage.empty())
+            IDSetSwitch(&CoverControl, nullptr);
+        else
+            IDSetSwitch(&CoverControl, "%s", coverMessage.c_str());
+        coverMessage.clear();
+    }
+    if (changed & BRIGHTNESS_VECTOR)
+    {
+        if (brightnessMessage.empty())
+            IDSetNumber(&BrightnessControl, nullptr);
+        else
+            IDSetNumber(&BrightnessControl, "%s", brightnessMessage.c_str());
+        brightnessMessage.clear();
+    }
+    if (changed & STATUS_VECTOR)
+        IDSetText(&StatusFeedback, nullptr);
+    if (changed & UPDATES_VECTOR)
+        IDSetNumber(&BrightnessUpdates, nullptr);
+}
+
+void FlatPanelCover::applyCoverEvent(PanelEvent::Type type)
+{
+    // The switch keeps showing the move just requested until a report that
+    // cannot predate it arrives
+    if (coverReportStale && (type == PanelEvent::COVER_OPEN || type == PanelEvent::COVER_CLOSED))
+        return;
+
+    switch (type)
+    {
+        case PanelEvent::COVER_OPEN:
+            CoverOptions[0].s = ISS_ON;
+            CoverOptions[1].s = ISS_OFF;
+            IUSaveText(&StatusMessages[0], "Cover Open");
+            reportedCover = 0;
+            coverMoving = false;
+            break;
+        case PanelEvent::COVER_CLOSED:
+            CoverOptions[0].s = ISS_OFF;
+            CoverOptions[1].s = ISS_ON;
+            IUSaveText(&StatusMessages[0], "Cover Closed");
+            reportedCover = 1;
+            coverMoving = false;
+            break;
+        case PanelEvent::COVER_MOVING:
+            IUSaveText(&StatusMessages[0], "Cover Moving...");
+            coverMoving = true;
+            break;
+        case PanelEvent::COVER_HALTED:
+            CoverOptions[0].s = ISS_OFF;
+            CoverOptions[1].s = ISS_OFF;
+            IUSaveText(&StatusMessages[0], "Cover Halted");
+            // A report already on the wire when OPEN or CLOSE was pressed
+            // leaves that move busy
+            if (requestedCover < 0 && !commandsInFlight(QueuedCommand::COVER))
+                CoverControl.s = IPS_IDLE;
+            reportedCover = -1;
+            coverMoving = false;
+            break;
+        default:
+            break;
+    }
+}
+
+// One STATUS line is a complete snapshot, so it replaces a STATE and a
+// BRIGHTNESS exchange. The firmware bumps its sequence on every change and,
+// with EVENTS ON, pushes one STATUS per change: a jump of more than one means
+// lines were lost on the wire. When polling, jumps are just changes between polls.
+void FlatPanelCover::applyStatus(const PanelEvent &event)
+{
+    if (statusSequence >= 0 && pushEvents)
+    {
+        unsigned missed = (event.sequence - static_cast<unsigned>(statusSequence) - 1) & 0xffff;
+        if (missed > 0 && missed < 0x8000)
+        {
+            missedUpdates += missed;
+            IDLog("Missed %u panel update%s before STATUS #%u\n", missed, missed == 1 ? "" : "s", event.sequence);
+        }
+    }
+    statusSequence = static_cast<int>(event.sequence);
+
+    applyCoverEvent(coverPositionEvents[event.value]);
+    char text[64];
+    if (coverMoving)
+        snprintf(text, sizeof(text), "Cover Moving... %d%%", event.progress);
+    else
+        snprintf(text, sizeof(text), "%s, Light %s", StatusMessages[0].text, event.calibratorOn ? "On" : "Off");
+    IUSaveText(&StatusMessages[0], text);
+
+    BrightnessValue[0].value = event.brightness;
+    reportedBrightness = event.brightness;
+}
+
+void FlatPanelCover::handleLinkLost()
+{
+    // Pending requests are replayed by resyncPanel() once the panel is back;
+    // sequences are not, their later steps may no longer make sense
+    cancelSequences("link lost");
+    stopPolling();
+    cancelCommands();
+    stopIOThread();
+    closeLink();
+
+    IDLog("Lost connection to panel on %s, waiting for it to come back.\n", linkAddress.c_str());
+    IUSaveText(&StatusMessages[0], "Link lost, waiting for device...");
+    setConnectionStatus("Link to " + linkAddress + " lost, reconnecting...", IPS_ALERT);
+    StatusFeedback.s = IPS_ALERT;
+    CoverControl.s = IPS_ALERT;
+    BrightnessControl.s = IPS_ALERT;
+
+    // Only USB serial nodes come and go under /dev, and are reopened as soon as
+    // udev brings the node back; every link is also retried on a timer
+    if (transport->kind() == PanelTransport::SERIAL && !startHotplugWatch())
+        IDLog("Retrying %s every 2 s instead.\n", linkAddress.c_str());
+
+    // The device may already be back by the time the watch is in place
+    tryReconnect();
+}
+
+// udev creates the node (IN_CREATE) and then fixes its permissions (IN_ATTRIB);
+// both are watched so the reopen happens as soon as the node is usable.
+bool FlatPanelCover::startHotplugWatch()
+{
+    if (hotplugFD >= 0)
+        return true;
+
+    hotplugFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplugFD < 0 || inotify_add_watch(hotplugFD, "/dev", IN_CREATE | IN_ATTRIB) < 0)
+    {
+        IDLog("Cannot watch /dev for the panel to return: %s\n", strerror(errno));
+        stopHotplugWatch();
+        return false;
+    }
+
+    hotplugCallbackID = IEAddCallback(hotplugFD, hotplugCallback, this);
+    return true;
+}
+
+void FlatPanelCover::stopHotplugWatch()
+{
+    if (hotplugCallbackID >= 0)
+    {
+        IERmCallback(hotplugCallbackID);
+        hotplugCallbackID = -1;
+    }
+    if (hotplugFD >= 0)
+    {
+        close(hotplugFD);
+        hotplugFD = -1;
+    }
+}
+
+void FlatPanelCover::hotplugCallback(int fd, void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+
+    alignas(struct inotify_event) char buffer[4096];
+    bool candidate = false;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + n;)
+        {
+            struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+            if (event->len > 0 && (strncmp(event->name, "ttyUSB", 6) == 0 || strncmp(event->name, "ttyACM", 6) == 0))
+                candidate = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (candidate)
+        panel->tryReconnect();
+    panel->flushProperties();
+}
+
+// Starts a recovery attempt on the connect thread; finishReconnect() resumes
+// the link or leaves it to the next hotplug event or timer
+void FlatPanelCover::tryReconnect()
+{
+    if (connectThread.joinable())
+    {
+        // udev may still be fixing permissions on the node this attempt opens
+        reconnectAgain = true;
+        return;
+    }
+
+    reconnectAgain = false;
+    recovering = true;
+    if (startConnectThread())
+        return;
+    recovering = false;
+    scheduleReconnect();
+}
+
+// After a failed attempt. The hotplug watch may fire first; one timer at most.
+void FlatPanelCover::scheduleReconnect()
+{
+    if (reconnectTimerID < 0)
+        reconnectTimerID = IEAddTimer(2000, reconnectTimerCallback, this);
+}
+
+// Connect thread. The transport that was lost, or for serial the same panel,
+// found by its recorded USB identity if the node number changed.
+bool FlatPanelCover::reopenLink(std::string &error)
+{
+    if (transport->kind() != PanelTransport::SERIAL)
+    {
+        if (!transport->open(error))
+            return false;
+        linkFD = transport->fd();
+        return true;
+    }
+    if (openCachedPort())
+        return true;
+
+    int fd = probePort(linkAddress, linkSettings.suppressReset, connectCancelled);
+    if (fd < 0)
+    {
+        error = "panel not present";
+        return false;
+    }
+    adoptSerial(fd, linkAddress);
+    return true;
+}
+
+// Main thread, once a recovery attempt is done. Failed attempts are quiet,
+// the link-lost alert stays up until one succeeds.
+void FlatPanelCover::finishReconnect()
+{
+    recovering = false;
+    if (connectCancelled)
+    {
+        closeLink();
+        connectCancelled = false;
+        return;
+    }
+
+    if (linkFD >= 0)
+    {
+        applyNegotiatedLink();
+        IDSetNumber(&LinkSpeed, nullptr);
+    }
+
+    if (!connectResult || !startLink())
+    {
+        closeLink();
+        if (reconnectAgain)
+            tryReconnect();
+        else
+            scheduleReconnect();
+        return;
+    }
+
+    stopHotplugWatch();
+    if (reconnectTimerID >= 0)
+    {
+        IERmTimer(reconnectTimerID);
+        reconnectTimerID = -1;
+    }
+    IDLog("Reconnected to panel at %s\n", linkAddress.c_str());
+    setConnectionStatus("Reconnected to " + linkAddress, IPS_OK);
+    resyncPanel();
+    flushProperties();
+}
+
+void FlatPanelCover::reconnectTimerCallback(void *userpointer)
+{
+    FlatPanelCover *panel = static_cast<FlatPanelCover *>(userpointer);
+    panel->reconnectTimerID = -1;
+    panel->tryReconnect();
+    panel->flushProperties();
+}
+
+// Replays the last cover and brightness requests and asks for the state so the
+// replies can confirm them. checkResync() clears the alert once they match;
+// a cover still moving is confirmed by the STATE it reports on arrival.
+void FlatPanelCover::resyncPanel()
+{
+    if (requestedCover >= 0)
+    {
+        queueCommand(QueuedCommand::COVER, requestedCover == 0 ? protocol::command<protocol::Open>() :
+                     protocol::command<protocol::Close>(), requestedCover == 1);
+        armMotionTimer();
+    }
+    if (requestedBrightness >= 0)
+        requestBrightness(requestedBrightness);
+    queueCommand(QueuedCommand::QUERY, statusQuery ? protocol::command<protocol::QueryStatus>() :
+                 protocol::command<protocol::QueryState>());
+    // A firmware restart forgets EVENTS ON and restarts the STATUS sequence
+    statusSequence = -1;
+    if (pushEvents)
+    {
+        // The reply is just a Reply line to the I/O thread; nothing waits for it
+        char command[16];
+        if (protocol::encode<protocol::SetEvents>(command, sizeof(command), 1) >= 0)
+            sendCommand(command);
+    }
+    schedulePoll(true);
+
+    reportedCover = -1;
+    reportedBrightness = -1;
+    resyncPending = true;
+    IUSaveText(&StatusMessages[0], "Reconnected, resynchronising...");
+    StatusFeedback.s = IPS_BUSY;
+    checkResync();
+}
+
+void FlatPanelCover::checkResync()
+{
+    // Only replies received since the resync count, not the values from before the drop
+    bool coverMatches = requestedCover < 0 || reportedCover == requestedCover;
+    bool brightnessMatches = requestedBrightness < 0 || reportedBrightness == requestedBrightness;
+    if (!coverMatches || !brightnessMatches)
+        return;
+
+    resyncPending = false;
+    IDLog("Panel state confirmed after reconnect.\n");
+    StatusFeedback.s = IPS_OK;
+    CoverControl.s = IPS_OK;
+    BrightnessControl.s = IPS_OK;
+}
+
+bool FlatPanelCover::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+{
+    if (dev == nullptr || strcmp(dev, getDeviceName()) != 0)
+        return false;
+
+    // Applies from the next open, so it can be changed while disconnected
+    if (strcmp(name, AutoReset.name) == 0)
+    {
+        IUUpdateSwitch(&AutoReset, states, names, n);
+        AutoReset.s = IPS_OK;
+        IDSetSwitch(&AutoReset, nullptr);
+        return true;
+    }
+
+    if (strcmp(name, Framing.name) == 0)
+    {
+        IUUpdateSwitch(&Framing, states, names, n);
+        Framing.s = IPS_OK;
+        IDSetSwitch(&Framing, nullptr);
+        return true;
+    }
+
+    if (strcmp(name, TransportMode.name) == 0)
+    {
+        IUUpdateSwitch(&TransportMode, states, names, n);
+        TransportMode.s = IPS_OK;
+        IDSetSwitch(&TransportMode, nullptr);
+        return true;
+    }
+
+    // CONNECT only starts the attempt and leaves the switch busy; DISCONNECT
+    // during it cancels. A connected panel, recovering or not, is disconnected
+    // by DefaultDevice.
+    if (strcmp(name, "CONNECTION") == 0)
+    {
+        bool connect = false, disconnect = false;
+        for (int i = 0; i < n; ++i)
+        {
+            if (states[i] != ISS_ON)
+                continue;
+            connect |= strcmp(names[i], "CONNECT") == 0;
+            disconnect |= strcmp(names[i], "DISCONNECT") == 0;
+        }
+
+        if (connect && !connectThread.joinable() && !isConnected())
+        {
+            if (!Connect())
+            {
+                setConnectionStatus("Connection failed", IPS_ALERT);
+                setConnected(false, IPS_ALERT);
+                return true;
+            }
+            setConnectionStatus("Connecting...", IPS_BUSY);
+            setConnected(true, IPS_BUSY);
+            return true;
+        }
+        if (connectThread.joinable() && !recovering)
+        {
+            if (disconnect)
+                cancelConnect();
+            // A CONNECT while the cancelled attempt winds down is refused
+            if (disconnect || connectCancelled)
+                setConnected(false, disconnect ? IPS_IDLE : IPS_ALERT);
+            else
+                setConnected(true, IPS_BUSY);
+            return true;
+        }
+    }
+
+    if (!linkReady())
+        return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
+
+    if (strcmp(name, CoverControl.name) == 0)
+    {
+        IUUpdateSwitch(&CoverControl, states, names, n);
+        int position = IUFindOnSwitchIndex(&CoverControl);
+        // A client moving the cover by hand takes over from a running sequence
+        cancelSequences("cover moved by a client");
+        if (position >= 0)
+            commandCover(position);
+        // The client always gets an answer, even if nothing changed
+        markDirty(COVER_VECTOR);
+        flushProperties();
+        return true;
+    }
+
+    if (strcmp(name, FlatCalibration.name) == 0)
+    {
+        IUUpdateSwitch(&FlatCalibration, states, names, n);
+        int action = IUFindOnSwitchIndex(&FlatCalibration);
+        if (action >= 0)
+            startFlatCalibration(action == 0);
+        else
+        {
+            cancelSequences("cancelled by a client");
+            FlatCalibration.s = IPS_IDLE;
+            IDSetSwitch(&FlatCalibration, nullptr);
+        }
+        flushProperties();
+        return true;
+    }
+
+    // HALT stops the cover where it is; nothing is replayed after a reconnect
+    if (strcmp(name, AbortControl.name) == 0)
+    {
+        cancelSequences("aborted");
+        requestedCover = -1;
+        stopMotionTimer();
+        queueCommand(QueuedCommand::COVER, protocol::command<protocol::Halt>(), true);
+        schedulePoll(true);
+
+        AbortOption[0].s = ISS_OFF;
+        AbortControl.s = IPS_OK;
+        IDSetSwitch(&AbortControl, nullptr);
+        IUResetSwitch(&CoverControl);
+        CoverControl.s = IPS_IDLE;
+        flushProperties();
+        return true;
+    }
+
+    return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
+}
+
+bool FlatPanelCover::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+{
+    if (dev == nullptr || strcmp(dev, getDeviceName()) != 0)
+        return false;
+
+    if (strcmp(name, CommandWindow.name) == 0)
+    {
+        IUUpdateNumber(&CommandWindow, values, names, n);
+        CommandWindow.s = IPS_OK;
+        IDSetNumber(&CommandWindow, nullptr);
+        if (linkReady())
+            pumpCommands();
+        return true;
+    }
+
+    // Budgets apply to commands sent from now on; the handshake reply budget from the next Connect
+    if (strcmp(name, TimeoutBudgets.name) == 0)
+    {
+        IUUpdateNumber(&TimeoutBudgets, values, names, n);
+        TimeoutBudgets.s = IPS_OK;
+        IDSetNumber(&TimeoutBudgets, nullptr);
+        return true;
+    }
+
+    if (strcmp(name, StatusPolling.name) == 0)
+    {
+        IUUpdateNumber(&StatusPolling, values, names, n);
+        StatusPolling.s = IPS_OK;
+        IDSetNumber(&StatusPolling, nullptr);
+        if (linkReady())
+            schedulePoll(true);
+        return true;
+    }
+
+    if (!linkReady())
+        return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
+
+    if (strcmp(name, BrightnessControl.name) == 0)
+    {
+        int brightness = static_cast<int>(values[0]);
+        if (brightness < 0) brightness = 0;
+        if (brightness > 4095) brightness = 4095;
+
+        cancelSequences("brightness changed by a client");
+        commandBrightness(brightness);
+        flushProperties();
+        return true;
+    }
+
+    if (strcmp(name, FlatBrightness.name) == 0)
+    {
+        IUUpdateNumber(&FlatBrightness, values, names, n);
+        FlatBrightness.s = IPS_OK;
+        IDSetNumber(&FlatBrightness, nullptr);
+        return true;
+    }
+
+    return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
+}
+
+bool FlatPanelCover::ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+    if (dev == nullptr || strcmp(dev, getDeviceName()) != 0)
+        return false;
+
+    if (strcmp(name, PortOverride.name) == 0)
+    {
+        IUUpdateText(&PortOverride, texts, names, n);
+        PortOverride.s = IPS_OK;
+        IDSetText(&PortOverride, nullptr);
+        return true;
+    }
+
+    // Transport settings apply from the next Connect
+    if (strcmp(name, TransportAddress.name) == 0)
+    {
+        IUUpdateText(&TransportAddress, texts, names, n);
+        TransportAddress.s = IPS_OK;
+        IDSetText(&TransportAddress, nullptr);
+        return true;
+    }
+
+    // Read-only: the identity is recorded by the driver itself and only the
+    // saved value from the config file is accepted
+    if (strcmp(name, USBIdentity.name) == 0)
+    {
+        if (!loadingConfig)
+        {
+            IDSetText(&USBIdentity, "USB Identity is read-only; it is recorded when the panel is found.");
+            return false;
+        }
+        IUUpdateText(&USBIdentity, texts, names, n);
+        IDSetText(&USBIdentity, nullptr);
+        return true;
+    }
+
+    return INDI::DefaultDevice::ISNewText(dev, name, texts, names, n);
+}
+
+static std::unique_ptr<FlatPanelCover> flatPanel(new FlatPanelCover());
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer
+// thread. push() fails instead of blocking when the queue is full; that is how
+// callers see backpressure. Each side caches the other side's index so the
+// shared cache line is only touched when the queue looks full or empty.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // Producer side
+    bool push(const T &item)
+    {
+        size_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (tail - cachedHead == Capacity)
+        {
+            cachedHead = headIndex.load(std::memory_order_acquire);
+            if (tail - cachedHead == Capacity)
+                return false;
+        }
+        slots[tail & (Capacity - 1)] = item;
+        tailIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T &item)
+    {
+        size_t head = headIndex.load(std::memory_order_relaxed);
+        if (head == cachedTail)
+        {
+            cachedTail = tailIndex.load(std::memory_order_acquire);
+            if (head == cachedTail)
+                return false;
+        }
+        item = slots[head & (Capacity - 1)];
+        headIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; only safe while the producer is not running
+    void clear()
+    {
+        T item;
+        while (pop(item))
+            ;
+    }
+
+    // Approximate when called concurrently with the other side
+    size_t size() const
+    {
+        return tailIndex.load(std::memory_order_acquire) - headIndex.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+
+private:
+    // Consumer-owned line
+    alignas(64) std::atomic<size_t> headIndex { 0 };
+    size_t cachedTail = 0;
+
+    // Producer-owned line
+    alignas(64) std::atomic<size_t> tailIndex { 0 };
+    size_t cachedHead = 0;
+
+    alignas(64) T slots[Capacity];
+};